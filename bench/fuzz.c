@@ -0,0 +1,752 @@
+/*** includes ***/
+#define KILO_NO_MAIN
+#include "../kilo.c"
+#include "reference.h"
+
+/*** differential fuzzer ***/
+// Runs random edits against the editor and against a model that keeps the
+// whole buffer as one flat string, and checks after every step that rows,
+// renders, the row indexes and highlighting all agree with it. Runs of
+// edits are undone at the end and have to give back what they started
+// from, and the buffer has to know when it is the file on disk again. On a
+// mismatch it prints the seed and step to replay.
+//   ./fuzz [seed] [steps]
+
+struct model {
+    char *s; // Rows joined with newlines, never fewer than one row
+    size_t len;
+};
+
+struct model M;
+struct model Disk; // M as it was last saved or reloaded
+unsigned long long fuzzState;
+unsigned long long fuzzSeed;
+long fuzzStep;
+const char *fuzzOp = "setup";
+
+unsigned fuzzRand(unsigned n) {
+    // xorshift64, so a seed replays the same run anywhere
+    fuzzState ^= fuzzState << 13;
+    fuzzState ^= fuzzState >> 7;
+    fuzzState ^= fuzzState << 17;
+    return n ? fuzzState % n : 0;
+}
+
+void fuzzFail(const char *fmt, ...) {
+    va_list ap;
+    fprintf(stderr, "seed %llu step %ld after %s: ", fuzzSeed, fuzzStep, fuzzOp);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+// Bytes that mean something to the lexer, plus plain text
+const char *fuzzChars = "/*\"'\\\t  abif0x19._;(){}[]";
+const char *fuzzTokens[] = {
+    "if", "int", "while", "//", "/*", "*/", "\"", "'", "\\", "0x1f", "1.5",
+    "\t", " ", "x", "return", "char", "a.b", "/", "*", "(", ")", "{", "}",
+    "[", "]", "f(", "){",
+};
+#define FUZZ_TOKENS (sizeof(fuzzTokens) / sizeof(fuzzTokens[0]))
+
+// A random string of tokens, owned by the caller
+char *fuzzString(int maxtokens, int *len) {
+    int n = fuzzRand(maxtokens + 1);
+    char *s = malloc(n * 8 + 1);
+    *len = 0;
+    int j;
+    for(j = 0; j < n; j++) {
+	const char *t = fuzzTokens[fuzzRand(FUZZ_TOKENS)];
+	memcpy(&s[*len], t, strlen(t));
+	*len += strlen(t);
+    }
+    s[*len] = '\0';
+    return s;
+}
+
+/*** model ***/
+
+void modelSplice(size_t at, size_t del, const char *ins, size_t inslen) {
+    char *s = malloc(M.len - del + inslen + 1);
+    memcpy(s, M.s, at);
+    memcpy(&s[at], ins, inslen);
+    memcpy(&s[at + inslen], &M.s[at + del], M.len - at - del);
+    M.len = M.len - del + inslen;
+    s[M.len] = '\0';
+    free(M.s);
+    M.s = s;
+}
+
+int modelRows() {
+    int n = 1;
+    size_t j;
+    for(j = 0; j < M.len; j++) n += M.s[j] == '\n';
+    return n;
+}
+
+// Offset of a row and column, found by scanning rather than by the index.
+// The row past the last one starts after an implicit newline
+size_t modelOffset(int y, int x) {
+    size_t off = 0;
+    while (y > 0) {
+	char *nl = memchr(&M.s[off], '\n', M.len - off);
+	if(nl == NULL) return M.len + 1;
+	off = nl - M.s + 1;
+	y--;
+    }
+    return off + x;
+}
+
+void modelInsertRow(int at, const char *s, int len) {
+    if(at == modelRows()) {
+	modelSplice(M.len, 0, "\n", 1);
+	modelSplice(M.len, 0, s, len);
+    } else {
+	size_t off = modelOffset(at, 0);
+	modelSplice(off, 0, "\n", 1);
+	modelSplice(off, 0, s, len);
+    }
+}
+
+// Needs at least two rows
+void modelDeleteRow(int at) {
+    int rows = modelRows();
+    size_t from = modelOffset(at, 0);
+    size_t to = at + 1 < rows ? modelOffset(at + 1, 0) : M.len;
+    // The last row takes the newline before it with it
+    if(at == rows - 1) from--;
+    modelSplice(from, to - from, "", 0);
+}
+
+/*** checks ***/
+
+// The bracket matching the one at (at, rx) by walking every row between
+int fuzzBracketMatch(int at, int rx, int *mrow, int *mrx) {
+    int dir, t = bracketType(E.row[at].render[rx], &dir);
+    int d = 1, i = rx + dir;
+    while (at >= 0 && at < E.numrows) {
+	erow *row = &E.row[at];
+	for(; i >= 0 && i < row->rsize; i += dir) {
+	    int bdir;
+	    if(bracketType(row->render[i], &bdir) != t || !bracketIsCode(row, i))
+		continue;
+	    d += bdir * dir;
+	    if(d == 0) {
+		*mrow = at;
+		*mrx = i;
+		return 1;
+	    }
+	}
+	at += dir;
+	if(at >= 0 && at < E.numrows) i = dir > 0 ? 0 : E.row[at].rsize - 1;
+    }
+    return 0;
+}
+
+// Wherever the gap is, every leaf has to hold its row's count, the free
+// ones nothing and every node the sum of its two
+void fuzzCheckBracketIndex() {
+    struct bracketIndex *ix = &E.brackets;
+    bracketIndexFlush(ix);
+    if(ix->n != E.numrows) fuzzFail("bracket index has %d rows", ix->n);
+    struct bracketSum empty, sum;
+    memset(&empty, 0, sizeof(empty));
+    int leaf, i;
+    for(leaf = 0; leaf < ix->size; leaf++) {
+	struct bracketSum *b = &ix->tree[ix->size + leaf];
+	if(leaf >= ix->gap && leaf < ix->gap + ix->size - ix->n) {
+	    if(memcmp(b, &empty, sizeof(empty)))
+		fuzzFail("free bracket leaf %d isn't empty", leaf);
+	    continue;
+	}
+	erow *row = &E.row[bracketLeafRow(ix, leaf)];
+	if(row->brackets_stale) fuzzFail("row %d not counted again", row->idx);
+	bracketCount(row);
+	if(memcmp(b, &row->brackets, sizeof(sum)))
+	    fuzzFail("bracket leaf of row %d is out of date", row->idx);
+    }
+    for(i = ix->size - 1; i >= 1; i--) {
+	bracketCombine(&sum, &ix->tree[2 * i], &ix->tree[2 * i + 1]);
+	if(memcmp(&sum, &ix->tree[i], sizeof(sum)))
+	    fuzzFail("bracket node %d isn't the sum of its leaves", i);
+    }
+}
+
+void fuzzCheckBrackets() {
+    fuzzCheckBracketIndex();
+    int k;
+    for(k = 0; k < 4; k++) {
+	int at = fuzzRand(E.numrows), rx, dir;
+	erow *row = &E.row[at];
+	for(rx = 0; rx < row->rsize; rx++) {
+	    if(bracketType(row->render[rx], &dir) < 0 || !bracketIsCode(row, rx))
+		continue;
+	    int r1 = -1, x1 = -1, r2 = -1, x2 = -1;
+	    int found = editorFindBracketMatch(at, rx, &r1, &x1);
+	    if(found != fuzzBracketMatch(at, rx, &r2, &x2) || r1 != r2 || x1 != x2)
+		fuzzFail("bracket at row %d column %d matched %d:%d, expected %d:%d",
+			at, rx, r1, x1, r2, x2);
+	}
+    }
+}
+
+// Rows outside the changed range have to be the file's lines whatever they
+// hash to, and the buffer is clean exactly when it is the file
+void fuzzCheckDisk() {
+    if(E.diskhash == NULL) return;
+    int lines = 1, j, k = 1;
+    size_t i;
+    for(i = 0; i < Disk.len; i++) lines += Disk.s[i] == '\n';
+    size_t *start = malloc(sizeof(size_t) * (lines + 1));
+    start[0] = 0;
+    for(i = 0; i < Disk.len; i++) if(Disk.s[i] == '\n') start[k++] = i + 1;
+    start[lines] = Disk.len + 1;
+    if(E.disklines != lines)
+	fuzzFail("%d line hashes, the file has %d lines", E.disklines, lines);
+
+    if(E.changelo != -1) {
+	for(j = 0; j < E.changelo + E.changetail; j++) {
+	    int y = j < E.changelo ? j : E.numrows - 1 - (j - E.changelo);
+	    int l = j < E.changelo ? j : lines - 1 - (j - E.changelo);
+	    erow *row = &E.row[y];
+	    size_t len = start[l + 1] - 1 - start[l];
+	    if((size_t) row->size != len || memcmp(row->chars, &Disk.s[start[l]], len))
+		fuzzFail("row %d is outside the changes but isn't line %d", y, l);
+	}
+    }
+    free(start);
+
+    editorNarrowChanges();
+    int same = M.len == Disk.len && !memcmp(M.s, Disk.s, M.len);
+    if(same && E.changelo != -1)
+	fuzzFail("rows are the file again but still marked changed");
+    if(!same && (E.changelo == -1 || E.dirty == 0))
+	fuzzFail("rows differ from the file but nothing is marked");
+}
+
+void fuzzCheck() {
+    int rows = modelRows();
+    if(E.numrows != rows) fuzzFail("%d rows, model has %d", E.numrows, rows);
+
+    size_t off = 0;
+    int j;
+    for(j = 0; j < E.numrows; j++) {
+	erow *row = &E.row[j];
+	char *nl = memchr(&M.s[off], '\n', M.len - off);
+	size_t len = (nl ? (size_t) (nl - M.s) : M.len) - off;
+	if(row->idx != j) fuzzFail("row %d has idx %d", j, row->idx);
+	if((size_t) row->size != len || memcmp(row->chars, &M.s[off], len))
+	    fuzzFail("row %d is \"%s\", model has \"%.*s\"", j, row->chars,
+		    (int) len, &M.s[off]);
+	if(row->chars[row->size] != '\0') fuzzFail("row %d not terminated", j);
+	if(rowIndexSum(&E.byteindex, j) != (long long) off)
+	    fuzzFail("byte index puts row %d at %lld, model at %zu", j,
+		    rowIndexSum(&E.byteindex, j), off);
+
+	// Tabs expand to the next stop
+	int rx = 0, k;
+	for(k = 0; k < row->size; k++) {
+	    if(row->chars[k] == '\t') {
+		do {
+		    if(rx >= row->rsize || row->render[rx] != ' ')
+			fuzzFail("row %d renders tab at %d wrong", j, k);
+		    rx++;
+		} while (rx % KILO_TAB_STOP);
+	    } else {
+		if(rx >= row->rsize || row->render[rx] != row->chars[k])
+		    fuzzFail("row %d renders column %d wrong", j, k);
+		rx++;
+	    }
+	}
+	if(rx != row->rsize) fuzzFail("row %d renders %d wide, expected %d", j,
+		row->rsize, rx);
+	off += len + 1;
+    }
+    if(rowIndexTotal(&E.byteindex) != (long long) off)
+	fuzzFail("byte index total %lld, model %zu", rowIndexTotal(&E.byteindex), off);
+
+    // The other clients' widths have indexes that have to keep up too
+    int k;
+    for(k = 0; k < E.nwraps; k++) {
+	struct rowIndex *ix = E.wraps[k];
+	long long lines = 0;
+	for(j = 0; j < E.numrows; j++) {
+	    if(rowIndexSum(ix, j) != lines)
+		fuzzFail("%d wide wrap index puts row %d at line %lld, expected %lld",
+			ix->cols, j, rowIndexSum(ix, j), lines);
+	    int w = E.row[j].rsize;
+	    lines += w <= ix->cols ? 1 : (w + ix->cols - 1) / ix->cols;
+	}
+    }
+
+    if(E.cy < E.numrows && editorCursorOffset() != (long long) modelOffset(E.cy, E.cx))
+	fuzzFail("cursor at %lld, model at %zu", editorCursorOffset(),
+		modelOffset(E.cy, E.cx));
+
+    // Highlight everything again from the top with the old highlighter and
+    // compare. Equal results leave nothing to restore
+    unsigned char **hl = malloc(sizeof(unsigned char *) * (E.numrows + 1));
+    int *open = malloc(sizeof(int) * (E.numrows + 1));
+    for(j = 0; j < E.numrows; j++) {
+	open[j] = E.row[j].hl_open_comment;
+	editorEnsureSyntax(&E.row[j]);
+	hl[j] = malloc(E.row[j].rsize + 1);
+	if(E.row[j].rsize) memcpy(hl[j], E.row[j].hl, E.row[j].rsize);
+    }
+    for(j = 0; j < E.numrows; j++) referenceUpdateSyntax(&E.row[j]);
+    for(j = 0; j < E.numrows; j++) {
+	if(E.row[j].rsize && memcmp(hl[j], E.row[j].hl, E.row[j].rsize))
+	    fuzzFail("row %d highlighted differently: \"%s\"", j, E.row[j].render);
+	if(open[j] != E.row[j].hl_open_comment)
+	    fuzzFail("row %d comment state differs: \"%s\"", j, E.row[j].render);
+	free(hl[j]);
+    }
+    free(hl);
+    free(open);
+
+    fuzzCheckBrackets();
+    fuzzCheckDisk();
+}
+
+/*** edits ***/
+
+void fuzzMoveCursor() {
+    E.cy = fuzzRand(E.numrows + 1);
+    E.cx = E.cy < E.numrows ? (int) fuzzRand(E.row[E.cy].size + 1) : 0;
+}
+
+// Leaves rows the way opening a file from the session cache does, with a
+// comment state but no highlighting, for the next edit to run into.
+// Brackets counted without the highlighting have to come out the same
+void fuzzForgetSyntax() {
+    int j;
+    for(j = 0; j < E.numrows; j++) {
+	if(fuzzRand(2)) continue;
+	erow *row = &E.row[j];
+	int stale = row->brackets_stale;
+	bracketCount(row);
+	struct bracketSum b = row->brackets;
+	free(row->hl);
+	row->hl = NULL;
+	bracketCount(row);
+	if(memcmp(&b, &row->brackets, sizeof(b)))
+	    fuzzFail("row %d brackets differ without highlighting", j);
+	row->brackets_stale = stale;
+    }
+}
+
+struct fuzzLine {
+    char *s;
+    size_t len;
+};
+
+int fuzzLineCmp(const void *a, const void *b) {
+    const struct fuzzLine *x = a, *y = b;
+    int c = memcmp(x->s, y->s, x->len < y->len ? x->len : y->len);
+    if(c) return c;
+    return x->len < y->len ? -1 : x->len > y->len;
+}
+
+// Sort and unique on a region, checked against sorting the model's lines.
+// The threaded merge is checked on its own first, since there may not be
+// enough CPUs or rows for the editor to use it
+void fuzzSortLines() {
+    int unique = fuzzRand(2), j, t;
+    fuzzOp = unique ? "unique lines" : "sort lines";
+
+    struct sortKey *one = malloc(sizeof(struct sortKey) * E.numrows);
+    for(j = 0; j < E.numrows; j++) one[j].row = j;
+    editorSortKeys(one, E.numrows, 0, 1);
+    for(t = 2; t <= KILO_SORT_THREADS; t *= 2) {
+	struct sortKey *many = malloc(sizeof(struct sortKey) * E.numrows);
+	for(j = 0; j < E.numrows; j++) many[j].row = j;
+	editorSortKeys(many, E.numrows, 0, t);
+	for(j = 0; j < E.numrows; j++)
+	    if(many[j].row != one[j].row)
+		fuzzFail("%d threads sort row %d to %d, one thread %d", t,
+			many[j].row, j, one[j].row);
+	free(many);
+    }
+    free(one);
+
+    E.marky = -1;
+    if(fuzzRand(3)) {
+	E.marky = fuzzRand(E.numrows + 1);
+	E.markx = fuzzRand(3) ? 0 : fuzzRand(10);
+    }
+    int sy, sx, ey, ex;
+    if(!editorGetRegion(&sy, &sx, &ey, &ex)) {
+	sy = 0;
+	ey = E.numrows - 1;
+    } else if(ex == 0 && ey > sy) {
+	ey--;
+    }
+    size_t from = modelOffset(sy, 0);
+    size_t to = ey + 1 < E.numrows ? modelOffset(ey + 1, 0) - 1 : M.len;
+    editorSortLines(unique);
+
+    int n = ey - sy + 1, k = 0;
+    struct fuzzLine *lines = malloc(sizeof(struct fuzzLine) * n);
+    size_t p = from;
+    for(j = 0; j < n; j++) {
+	char *nl = memchr(&M.s[p], '\n', to - p);
+	lines[j].s = &M.s[p];
+	lines[j].len = nl ? (size_t) (nl - &M.s[p]) : to - p;
+	p += lines[j].len + 1;
+    }
+    qsort(lines, n, sizeof(struct fuzzLine), fuzzLineCmp);
+    char *out = malloc(to - from + 1);
+    size_t len = 0;
+    for(j = 0; j < n; j++) {
+	if(unique && j > 0 && fuzzLineCmp(&lines[j], &lines[j - 1]) == 0) continue;
+	if(k++) out[len++] = '\n';
+	memcpy(&out[len], lines[j].s, lines[j].len);
+	len += lines[j].len;
+    }
+    modelSplice(from, to - from, out, len);
+    free(out);
+    free(lines);
+}
+
+// One edit that goes through the undo stack, applied to both sides
+void fuzzEdit() {
+    if(fuzzRand(8) == 0) fuzzForgetSyntax();
+    fuzzMoveCursor();
+    int past = E.cy == E.numrows;
+    size_t at = modelOffset(E.cy, E.cx);
+
+    switch (fuzzRand(9)) {
+	case 0:
+	case 1: {
+	    fuzzOp = "insert char";
+	    char c = fuzzChars[fuzzRand(strlen(fuzzChars))];
+	    editorInsertChar(c);
+	    if(past) modelSplice(M.len, 0, "\n", 1), at = M.len;
+	    modelSplice(at, 0, &c, 1);
+	    break;
+	}
+	case 2:
+	    fuzzOp = "newline";
+	    editorInsertNewline();
+	    modelSplice(past ? M.len : at, 0, "\n", 1);
+	    break;
+	case 3:
+	    fuzzOp = "delete char";
+	    editorDelChar();
+	    if(!past && at > 0) modelSplice(at - 1, 1, "", 0);
+	    break;
+	case 4: {
+	    fuzzOp = "cut";
+	    E.marky = fuzzRand(E.numrows + 1);
+	    E.markx = fuzzRand(40);
+	    int sy, sx, ey, ex;
+	    if(!editorGetRegion(&sy, &sx, &ey, &ex)) {
+		E.marky = -1;
+		break;
+	    }
+	    size_t from = modelOffset(sy, sx), to = modelOffset(ey, ex);
+	    editorCut();
+	    if(E.cliplen != to - from || memcmp(E.clip, &M.s[from], to - from))
+		fuzzFail("clipboard has %zu bytes, model %zu", E.cliplen, to - from);
+	    modelSplice(from, to - from, "", 0);
+	    break;
+	}
+	case 5:
+	    fuzzOp = "paste";
+	    if(E.clip == NULL) break;
+	    editorPaste();
+	    if(past) modelSplice(M.len, 0, "\n", 1), at = M.len;
+	    modelSplice(at, 0, E.clip, E.cliplen);
+	    break;
+	case 6: {
+	    fuzzOp = "replace all";
+	    const char *query[] = {"a", "if", "*/", "\t", "/"};
+	    const char *with[] = {"", "xy", "/*", "\"", "//"};
+	    struct replaceJob job;
+	    job.query = (char *) query[fuzzRand(5)];
+	    job.qlen = strlen(job.query);
+	    job.with = (char *) with[fuzzRand(5)];
+	    job.wlen = strlen(job.with);
+	    if(past) break;
+	    if(strchr(job.query, '\t')) {
+		editorReplaceAll(&job, E.cy, E.cx);
+	    } else {
+		// Typed into the prompts the way Ctrl-R takes them, an empty
+		// replacement included
+		const char *k;
+		editorReplace();
+		for(k = job.query; *k; k++) editorPromptKey(*k);
+		editorPromptKey('\r');
+		for(k = job.with; *k; k++) editorPromptKey(*k);
+		editorPromptKey('\r');
+		if(E.prompt) editorPromptKey('a');
+		if(E.prompt) fuzzFail("replace prompt still up");
+	    }
+	    // The query never holds a newline, so replacing in the flat
+	    // string is the same as replacing row by row
+	    size_t p = at;
+	    char *m;
+	    while (p < M.len && (m = memmem(&M.s[p], M.len - p, job.query, job.qlen))) {
+		size_t mo = m - M.s;
+		modelSplice(mo, job.qlen, job.with, job.wlen);
+		p = mo + job.wlen;
+	    }
+	    break;
+	}
+	case 7: {
+	    fuzzOp = "multiple cursors";
+	    int keys[] = {'x', '\t', '(', BACKSPACE, DEL_KEY};
+	    int key = keys[fuzzRand(5)];
+	    int n = 1 + fuzzRand(8), j;
+	    E.ncursors = 0;
+	    for(j = 0; j < n; j++) {
+		int y = fuzzRand(E.numrows);
+		editorAddCursor(y, fuzzRand(E.row[y].size + 1));
+	    }
+	    E.primary = 0;
+	    editorNormalizeCursors(1);
+	    if(E.ncursors == 0) editorAddCursor(E.cy, E.cx);
+
+	    // Last cursor first so the offsets of the others stay put
+	    size_t *offs = malloc(sizeof(size_t) * E.ncursors);
+	    int *ends = malloc(sizeof(int) * E.ncursors);
+	    for(j = 0; j < E.ncursors; j++) {
+		offs[j] = modelOffset(E.cursors[j].cy, E.cursors[j].cx);
+		ends[j] = E.cursors[j].cx == E.row[E.cursors[j].cy].size;
+	    }
+	    int count = E.ncursors;
+	    editorCursorsEdit(key);
+	    for(j = count - 1; j >= 0; j--) {
+		int first = offs[j] == 0 || M.s[offs[j] - 1] == '\n';
+		if(key == BACKSPACE) {
+		    if(!first) modelSplice(offs[j] - 1, 1, "", 0);
+		} else if(key == DEL_KEY) {
+		    if(!ends[j]) modelSplice(offs[j], 1, "", 0);
+		} else {
+		    char c = key;
+		    modelSplice(offs[j], 0, &c, 1);
+		}
+	    }
+	    free(offs);
+	    free(ends);
+	    E.ncursors = 0;
+	    break;
+	}
+	case 8:
+	    fuzzSortLines();
+	    break;
+    }
+}
+
+void fuzzDiskIsModel() {
+    free(Disk.s);
+    Disk.s = malloc(M.len + 1);
+    memcpy(Disk.s, M.s, M.len + 1);
+    Disk.len = M.len;
+}
+
+// Changes a few lines of the file behind the editor's back and reloads it
+void fuzzReload() {
+    fuzzOp = "reload";
+    int k = fuzzRand(6), j;
+    for(j = 0; j < k; j++) {
+	int len;
+	char *s = fuzzString(6, &len);
+	int rows = modelRows(), at = fuzzRand(rows);
+	switch (fuzzRand(3)) {
+	    case 0:
+		modelInsertRow(at, s, len);
+		break;
+	    case 1:
+		if(rows > 1) modelDeleteRow(at);
+		break;
+	    case 2:
+		modelInsertRow(at, s, len);
+		modelDeleteRow(at + 1);
+		break;
+	}
+	free(s);
+    }
+
+    FILE *fp = fopen(E.filename, "w");
+    if(fp == NULL) fuzzFail("can't write %s", E.filename);
+    fwrite(M.s, 1, M.len, fp);
+    fputc('\n', fp);
+    fclose(fp);
+    E.cy = fuzzRand(E.numrows + 1);
+    E.cx = 0;
+    editorReloadFile();
+    // As editorCheckDisk would have before reloading
+    stat(E.filename, &E.disk);
+    fuzzDiskIsModel();
+}
+
+// Changes the file behind the editor's back and keeps the rows, as when
+// the reload is turned down, or has the reload fail. Either way the next
+// save has to write every row
+void fuzzKeep() {
+    fuzzOp = "keep";
+    FILE *fp = fopen(E.filename, "w");
+    if(fp == NULL) fuzzFail("can't write %s", E.filename);
+    // Same length with the first byte changed, so a save from the first
+    // changed row would leave it there
+    if(M.len) fputc(M.s[0] == 'Z' ? 'Y' : 'Z', fp);
+    fwrite(&M.s[M.len ? 1 : 0], 1, M.len ? M.len - 1 : 0, fp);
+    fputc('\n', fp);
+    fclose(fp);
+    // As editorCheckDisk does before asking
+    stat(E.filename, &E.disk);
+    if(fuzzRand(2)) {
+	editorKeepChanges();
+    } else {
+	unlink(E.filename);
+	editorReloadFile();
+    }
+    if(E.diskhash) fuzzFail("line hashes kept for a file that changed");
+}
+
+// Saves, usually only some of the rows, and reads the file back
+void fuzzSave() {
+    int y = fuzzRand(E.numrows);
+    if(fuzzRand(2) && E.row[y].size > 0) {
+	// Same length, so the row is written over itself and nothing else
+	fuzzOp = "overwrite";
+	int x = fuzzRand(E.row[y].size);
+	char c = fuzzChars[fuzzRand(strlen(fuzzChars))];
+	editorRowDelChar(&E.row[y], x);
+	editorRowInsertChar(&E.row[y], x, c);
+	modelSplice(modelOffset(y, x), 1, &c, 1);
+    }
+    fuzzOp = "save";
+    long long at;
+    if(editorWriteFile(&at) == -1) fuzzFail("can't save: %s", strerror(errno));
+    stat(E.filename, &E.disk);
+
+    FILE *fp = fopen(E.filename, "r");
+    if(fp == NULL) fuzzFail("can't read %s", E.filename);
+    char *buf = malloc(M.len + 2);
+    size_t len = fread(buf, 1, M.len + 2, fp);
+    fclose(fp);
+    if(len != M.len + 1 || memcmp(buf, M.s, M.len) || buf[M.len] != '\n')
+	fuzzFail("saved %zu bytes from %lld that aren't the rows", len, at);
+    free(buf);
+    fuzzDiskIsModel();
+}
+
+// Edits that bypass the undo stack, so they happen between runs
+void fuzzRawEdit() {
+    int len;
+    char *s = fuzzString(6, &len);
+    if(fuzzRand(3) == 0) {
+	// Rows that start alike make sorts look past their first bytes
+	const char *common = "\tif(value == 0x19) ";
+	int clen = strlen(common);
+	s = realloc(s, clen + len + 1);
+	memmove(&s[clen], s, len + 1);
+	memcpy(s, common, clen);
+	len += clen;
+    }
+    int at = fuzzRand(E.numrows + 1);
+    if(fuzzRand(3) || E.numrows == 1) {
+	fuzzOp = "insert row";
+	modelInsertRow(at, s, len);
+	editorInsertRow(at, s, len);
+    } else {
+	fuzzOp = "delete row";
+	if(at == E.numrows) at--;
+	modelDeleteRow(at);
+	editorDelRow(at);
+    }
+    free(s);
+
+    if(fuzzRand(6) == 0) fuzzReload();
+
+    if(fuzzRand(4) == 0) {
+	fuzzOp = "toggle wrap";
+	E.screencols = 4 + fuzzRand(30);
+	E.clients[fuzzRand(E.nclients)].view.screencols = 4 + fuzzRand(30);
+	editorToggleWrap();
+    }
+
+    if(fuzzRand(12) == 0) fuzzKeep();
+    // Right before a run, so undoing it comes back to the file
+    if(fuzzRand(4) == 0) fuzzSave();
+}
+
+int main(int argc, char *argv[]) {
+    fuzzSeed = argc > 1 ? strtoull(argv[1], NULL, 0) : 1;
+    long steps = argc > 2 ? atol(argv[2]) : 20000;
+    fuzzState = fuzzSeed * 2654435761u + 1;
+
+    initBuffer();
+    E.screenrows = 10;
+    E.screencols = 20;
+    // Clients of a server that nothing is sent to, for the widths they have
+    E.current = -1;
+    editorAddClient(open("/dev/null", O_WRONLY));
+    editorAddClient(open("/dev/null", O_WRONLY));
+    // Reloads go through a real file, named so it's highlighted as C
+    char path[] = "/tmp/kilo-fuzz-XXXXXX.c";
+    int fd = mkstemps(path, 2);
+    if(fd == -1) fuzzFail("mkstemps: %s", strerror(errno));
+    close(fd);
+    E.filename = strdup(path);
+    editorSelectSyntaxHighlight();
+
+    editorInsertRow(0, "", 0);
+    M.s = strdup("");
+    M.len = 0;
+    fuzzSave();
+    fuzzCheck();
+
+    for(fuzzStep = 0; fuzzStep < steps; ) {
+	fuzzRawEdit();
+	fuzzCheck();
+	fuzzStep++;
+
+	// A run of edits, undone afterwards
+	editorUndoClear();
+	char *before = malloc(M.len + 1);
+	memcpy(before, M.s, M.len + 1);
+	size_t beforelen = M.len;
+	int n = 1 + fuzzRand(50), j;
+	for(j = 0; j < n && fuzzStep < steps; j++, fuzzStep++) {
+	    fuzzEdit();
+	    fuzzCheck();
+	}
+	if(fuzzRand(2)) {
+	    fuzzOp = "undo";
+	    while (E.undolen) editorUndo();
+	    free(M.s);
+	    M.s = before;
+	    M.len = beforelen;
+	    fuzzCheck();
+	} else {
+	    free(before);
+	}
+
+	// Keep the buffer small enough for the checks to stay cheap
+	while (E.numrows > 60) {
+	    fuzzOp = "trim";
+	    size_t from = modelOffset(E.numrows - 1, 0) - 1;
+	    editorDelRow(E.numrows - 1);
+	    modelSplice(from, M.len - from, "", 0);
+	}
+	while (M.len > 4000) {
+	    fuzzOp = "trim";
+	    E.cy = 0;
+	    E.cx = 0;
+	    E.marky = E.numrows - 1;
+	    E.markx = E.row[E.numrows - 1].size;
+	    editorCut();
+	    free(M.s);
+	    M.s = strdup("");
+	    M.len = 0;
+	}
+    }
+    unlink(path);
+    printf("seed %llu: %ld steps ok, %d rows\n", fuzzSeed, steps, E.numrows);
+    return 0;
+}
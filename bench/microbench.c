@@ -0,0 +1,471 @@
+/*** includes ***/
+#define KILO_NO_MAIN
+#include "../kilo.c"
+
+/*** row operation benchmarks ***/
+// Times the primitives every edit and every frame goes through on
+// synthetic buffers that hit their worst cases, so a change to one of them
+// shows up as a number rather than as a sluggish editor.
+//   ./microbench [scale]
+
+double benchNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void benchReport(const char *name, long ops, double secs, double bytes) {
+    printf("%-28s %10ld ops %10.1f ns/op", name, ops, secs * 1e9 / ops);
+    if(bytes > 0) printf(" %8.1f MB/s", bytes / (1024 * 1024) / secs);
+    printf("\n");
+}
+
+// Throws the buffer away and starts an empty one highlighted as filename
+void benchReset(const char *filename) {
+    int j;
+    for(j = 0; j < E.numrows; j++) editorFreeRow(&E.row[j]);
+    free(E.row);
+    free(E.filename);
+    free(E.diskhash);
+    initBuffer();
+    E.screenrows = 50;
+    E.screencols = 160;
+    E.filename = strdup(filename);
+    editorSelectSyntaxHighlight();
+}
+
+void benchFill(int rows, const char *line) {
+    int j;
+    for(j = 0; j < rows; j++) editorInsertRow(E.numrows, (char *) line, strlen(line));
+}
+
+long benchBytes() {
+    long bytes = 0;
+    int j;
+    for(j = 0; j < E.numrows; j++) bytes += E.row[j].rsize;
+    return bytes;
+}
+
+// Appending is what opening a file does, inserting at the top is the worst
+// case for the row array and the indexes
+void benchInsertRow(int scale) {
+    const char *line = "\tint value = compute(left, right); // trailing comment";
+    int rows = 200000 * scale;
+    benchReset("bench.c");
+    double start = benchNow();
+    benchFill(rows, line);
+    benchReport("insert_row/append", rows, benchNow() - start, benchBytes());
+
+    int front = 20000 * scale;
+    start = benchNow();
+    int j;
+    for(j = 0; j < front; j++) editorInsertRow(0, (char *) line, strlen(line));
+    benchReport("insert_row/front", front, benchNow() - start, 0);
+
+    // The status bar asks for the cursor's offset after every one, and a
+    // wrapped screen for its visual line
+    int middle = 20000 * scale;
+    long long sum = 0;
+    start = benchNow();
+    for(j = 0; j < middle; j++) {
+	editorInsertRow(E.numrows / 2, (char *) line, strlen(line));
+	sum += rowIndexSum(&E.byteindex, E.numrows / 2);
+	sum += rowIndexSum(editorWrapIndex(), E.numrows / 2);
+    }
+    benchReport("insert_row/middle", middle, benchNow() - start, 0);
+
+    // Pasting a couple of lines splices them in
+    int pastes = 2000 * scale;
+    start = benchNow();
+    for(j = 0; j < pastes; j++) {
+	erow ins[2];
+	int k;
+	for(k = 0; k < 2; k++) {
+	    ins[k].size = strlen(line);
+	    ins[k].chars = strdup(line);
+	}
+	editorSpliceRows(E.numrows / 2, 0, ins, 2, NULL);
+	sum += rowIndexSum(editorWrapIndex(), E.numrows / 2);
+    }
+    benchReport("splice_rows/middle", pastes, benchNow() - start, 0);
+    if(sum == 0) printf("insert_row/middle: empty byte index\n");
+}
+
+// One row of a few megabytes, highlighted over and over
+void benchLongLine(int scale) {
+    benchReset("bench.c");
+    int len = 4 * 1024 * 1024;
+    char *s = malloc(len);
+    const char *pat = "if(x == 0x1f) return \"str\\\"ing\"; /* c */ ";
+    int plen = strlen(pat);
+    int j;
+    for(j = 0; j < len; j++) s[j] = pat[j % plen];
+    editorInsertRow(0, s, len);
+    free(s);
+
+    int passes = 20 * scale;
+    double start = benchNow();
+    for(j = 0; j < passes; j++) editorUpdateSyntax(&E.row[0]);
+    benchReport("update_syntax/long_line", passes, benchNow() - start,
+	    (double) E.row[0].rsize * passes);
+}
+
+// Opening and closing a comment on the first row changes the state of
+// every row below it, so each edit highlights the whole buffer again
+void benchCommentCascade(int scale) {
+    benchReset("bench.c");
+    benchFill(50000 * scale, "    x = y * z; while(1) { if(x) break; }");
+    editorInsertRow(0, "", 0);
+
+    int edits = 20;
+    double start = benchNow();
+    int j;
+    for(j = 0; j < edits; j++) {
+	editorRowInsertChar(&E.row[0], 0, '*');
+	editorRowInsertChar(&E.row[0], 0, '/');
+	editorRowDelChar(&E.row[0], 0);
+	editorRowDelChar(&E.row[0], 0);
+    }
+    benchReport("update_syntax/cascade", edits * 4, benchNow() - start,
+	    (double) benchBytes() * edits * 2);
+}
+
+// Rows that are mostly tabs render several times wider than they are
+void benchTabs(int scale) {
+    benchReset("bench.c");
+    int len = 64 * 1024;
+    char *s = malloc(len);
+    int j;
+    for(j = 0; j < len; j++) s[j] = j % 3 ? '\t' : 'x';
+    editorInsertRow(0, s, len);
+    free(s);
+
+    int passes = 200 * scale;
+    double start = benchNow();
+    for(j = 0; j < passes; j++) editorUpdateRender(&E.row[0]);
+    benchReport("update_render/tabs", passes, benchNow() - start,
+	    (double) len * passes);
+
+    // Moving through a long row converts every column from its start
+    int calls = 20000 * scale;
+    long sum = 0;
+    start = benchNow();
+    for(j = 0; j < calls; j++) sum += editorRowCxToRx(&E.row[0], (j * 7919) % len);
+    benchReport("row_cx_to_rx/tabs", calls, benchNow() - start, 0);
+    if(sum == 42) printf("\n");
+}
+
+// Follow mode appending small batches to a large log, then with a cap on
+// the rows it keeps
+void benchFollow(int scale) {
+    const char *line = "2024-01-01 12:00:00 INFO request handled in 12ms";
+    int batches = 20000 * scale, batch = 10, j, k;
+    erow rows[10];
+    int pass;
+    for(pass = 0; pass < 2; pass++) {
+	benchReset("bench.log");
+	benchFill(200000, line);
+	E.followmax = pass ? 200000 : 0;
+	double start = benchNow();
+	for(j = 0; j < batches; j++) {
+	    for(k = 0; k < batch; k++) {
+		rows[k].size = strlen(line);
+		rows[k].chars = strdup(line);
+	    }
+	    editorAppendRows(rows, batch);
+	    editorFollowEvict();
+	}
+	benchReport(pass ? "append_rows/capped" : "append_rows", (long) batches * batch,
+		benchNow() - start, 0);
+    }
+    E.followmax = 0;
+    E.evicted = 0;
+}
+
+// Opening a file cold and again with its session cache entry, which
+// skips highlighting until rows are drawn
+void benchOpen(int scale) {
+    char dir[] = "/tmp/kilo-bench-XXXXXX";
+    if(mkdtemp(dir) == NULL) return;
+    char path[64];
+    snprintf(path, sizeof(path), "%s/bench.c", dir);
+    setenv("KILO_CACHE_DIR", dir, 1);
+
+    FILE *fp = fopen(path, "w");
+    int rows = 200000 * scale, j;
+    fprintf(fp, "int main() {\n");
+    for(j = 0; j < rows; j++)
+	fprintf(fp, j % 3 ? "\tx = y(%d); /* c */\n" : "/* open %d\n close */\n", j);
+    fprintf(fp, "}\n");
+    fclose(fp);
+
+    int pass;
+    for(pass = 0; pass < 2; pass++) {
+	benchReset("bench.c");
+	double start = benchNow();
+	editorOpen(path);
+	benchReport(pass ? "open/cached" : "open", E.numrows, benchNow() - start,
+		benchBytes());
+	close(E.watchfd);
+    }
+
+    // The first match after a cached open counts brackets in every row,
+    // which mustn't leave them all highlighted
+    int mrow, mrx, highlighted = 0;
+    double start = benchNow();
+    if(!editorFindBracketMatch(0, 11, &mrow, &mrx) || mrow != E.numrows - 1) {
+	fprintf(stderr, "bracket_match/cached: wrong match\n");
+	exit(1);
+    }
+    benchReport("bracket_match/cached", 1, benchNow() - start, 0);
+    for(j = 0; j < E.numrows; j++) highlighted += E.row[j].hl != NULL;
+    if(highlighted > E.screenrows * 2) {
+	fprintf(stderr, "bracket_match/cached: %d rows highlighted\n", highlighted);
+	exit(1);
+    }
+
+    char cmd[128];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    if(system(cmd) != 0) fprintf(stderr, "can't remove %s\n", dir);
+    unsetenv("KILO_CACHE_DIR");
+}
+
+// Sorting a large buffer of log-like lines, undoing that, and deduping
+void benchSort(int scale) {
+    benchReset("bench.log");
+    int rows = 1000000 * scale, j;
+    char line[64];
+    unsigned int x = 12345;
+    for(j = 0; j < rows; j++) {
+	x = x * 1103515245 + 12345;
+	int len = snprintf(line, sizeof(line), "2024-01-01 host%02u request %u",
+		x >> 26, (x >> 8) % 50000);
+	editorInsertRow(E.numrows, line, len);
+    }
+    E.marky = -1;
+
+    double start = benchNow();
+    editorSortLines(0);
+    benchReport("sort_lines", rows, benchNow() - start, 0);
+    start = benchNow();
+    editorUndo();
+    benchReport("sort_lines/undo", rows, benchNow() - start, 0);
+    start = benchNow();
+    editorSortLines(1);
+    benchReport("unique_lines", rows, benchNow() - start, 0);
+}
+
+// Saving a large file after changing one line of it. A longer first line
+// moves everything after it, a changed character in the middle is written
+// over itself and a longer line near the end writes only from there
+void benchSave(int scale) {
+    char dir[] = "/tmp/kilo-bench-XXXXXX";
+    if(mkdtemp(dir) == NULL) return;
+    char path[64];
+    snprintf(path, sizeof(path), "%s/bench.log", dir);
+    setenv("KILO_CACHE_DIR", dir, 1);
+
+    FILE *fp = fopen(path, "w");
+    int rows = 2000000 * scale, j;
+    for(j = 0; j < rows; j++)
+	fprintf(fp, "2024-01-01 12:00:00 INFO request %d handled in 12ms\n", j);
+    fclose(fp);
+
+    benchReset("bench.log");
+    editorOpen(path);
+    const char *names[] = {"save/first_line", "save/in_place", "save/near_end"};
+    int at[] = {0, rows / 2, rows - 1000};
+    for(j = 0; j < 3; j++) {
+	erow *row = &E.row[at[j]];
+	if(j == 1) editorRowDelChar(row, 0);
+	editorRowInsertChar(row, 0, 'x');
+	double start = benchNow();
+	editorSave();
+	benchReport(names[j], 1, benchNow() - start, 0);
+    }
+
+    // Typing a character and deleting it again leaves the buffer clean
+    erow *row = &E.row[rows / 2];
+    int edits = 100000 * scale;
+    double start = benchNow();
+    for(j = 0; j < edits; j++) {
+	editorRowInsertChar(row, 10, 'y');
+	editorNarrowChanges();
+	editorRowDelChar(row, 10);
+	editorNarrowChanges();
+    }
+    benchReport("narrow_changes", edits * 2, benchNow() - start, 0);
+    if(E.dirty) printf("buffer still modified\n");
+
+    close(E.watchfd);
+    char cmd[128];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    if(system(cmd) != 0) fprintf(stderr, "can't remove %s\n", dir);
+    unsetenv("KILO_CACHE_DIR");
+}
+
+// Frames of the hex view at random offsets of a large binary file, and a
+// search for bytes that aren't in it
+void benchHex(int scale) {
+    char path[] = "/tmp/kilo-bench-XXXXXX";
+    int fd = mkstemp(path);
+    if(fd == -1) return;
+    long long size = 64LL * 1024 * 1024 * scale;
+    unsigned int x = 12345;
+    char buf[65536];
+    long long done;
+    int j;
+    for(done = 0; done < size; done += sizeof(buf)) {
+	for(j = 0; j < (int) sizeof(buf); j++) {
+	    x = x * 1103515245 + 12345;
+	    buf[j] = x >> 24;
+	}
+	if(write(fd, buf, sizeof(buf)) != sizeof(buf)) break;
+    }
+    close(fd);
+
+    benchReset("bench.bin");
+    editorOpenHex(path);
+    int frames = 2000 * scale;
+    double start = benchNow();
+    for(j = 0; j < frames; j++) {
+	struct abuf ab = ABUF_INIT;
+	x = x * 1103515245 + 12345;
+	editorHexGoto((long long) x * 16 % size);
+	editorDrawHex(&ab);
+	abFree(&ab);
+    }
+    benchReport("draw_hex", frames, benchNow() - start, 0);
+
+    unsigned char pat[] = {0xde, 0xad, 0xbe, 0xef, 0x01, 0x02, 0x03, 0x04};
+    start = benchNow();
+    long long at = editorHexSearch(pat, sizeof(pat), 0, 1);
+    benchReport("hex_search", 1, benchNow() - start, size);
+    if(at == -2) printf("\n");
+
+    munmap(E.hexmap, E.hexsize);
+    unlink(path);
+}
+
+// A server typing into a large buffer for four clients, each of which
+// gets the lines that changed on its screen
+void benchServe(int scale) {
+    benchReset("bench.c");
+    benchFill(200000, "\tint value = compute(left, right); // trailing comment");
+    E.current = -1;
+    int clients = 4, j;
+    for(j = 0; j < clients; j++) {
+	editorAddClient(open("/dev/null", O_WRONLY));
+	editorSwitchClient(j);
+	E.cy = j * 1000;
+    }
+
+    int frames = 5000 * scale;
+    double start = benchNow();
+    for(j = 0; j < frames; j++) {
+	editorSwitchClient(j % clients);
+	editorInsertChar('x');
+	editorRefreshClients();
+    }
+    benchReport("serve/4_clients", frames, benchNow() - start, 0);
+
+    // Soft wrap on terminals of two different widths
+    for(j = 0; j < clients; j++) {
+	editorSwitchClient(j);
+	E.screencols = j % 2 ? 120 : 80;
+	E.wrap = 1;
+	E.rowoff = 0;
+    }
+    frames = 500 * scale;
+    start = benchNow();
+    for(j = 0; j < frames; j++) {
+	editorSwitchClient(j % clients);
+	editorInsertChar('x');
+	editorRefreshClients();
+    }
+    benchReport("serve/4_clients_wrap", frames, benchNow() - start, 0);
+    while (E.nclients) editorDropClient(0);
+}
+
+// Pressing enter inside a long function and matching its braces on the
+// next frame, the bracket index has to keep up with every new row
+void benchBracketMatch(int scale) {
+    const char *line = "\tif(left) { value = compute(left, right); }";
+    int rows = 200000 * scale;
+    benchReset("bench.c");
+    editorInsertRow(0, "int main() {", 12);
+    benchFill(rows, line);
+    editorInsertRow(E.numrows, "}", 1);
+
+    int inserts = 2000 * scale;
+    int mrow, mrx;
+    double start = benchNow();
+    int j;
+    for(j = 0; j < inserts; j++) {
+	editorInsertRow(E.numrows / 2, (char *) line, strlen(line));
+	if(!editorFindBracketMatch(0, 11, &mrow, &mrx) || mrow != E.numrows - 1) {
+	    fprintf(stderr, "bracket_match: wrong match\n");
+	    exit(1);
+	}
+    }
+    benchReport("bracket_match/insert", inserts, benchNow() - start, 0);
+}
+
+// Full frames over a large highlighted buffer, scrolled a page at a time,
+// with and without soft wrap
+void benchDrawRows(int scale) {
+    benchReset("bench.c");
+    const char *lines[] = {
+	"static int counter = 0; /* shared between calls */",
+	"\tfor(int i = 0; i < n; i++) sum += weights[i] * 0.5; // accumulate a rather long line that wraps",
+	"\tprintf(\"%s\\n\", \"a string\");",
+	"",
+    };
+    int rows = 200000 * scale;
+    int j;
+    for(j = 0; j < rows; j++) {
+	const char *line = lines[j % 4];
+	editorInsertRow(E.numrows, (char *) line, strlen(line));
+    }
+
+    int frames = 2000 * scale;
+    double start = benchNow();
+    for(j = 0; j < frames; j++) {
+	struct abuf ab = ABUF_INIT;
+	E.rowoff = (long) j * E.screenrows % E.numrows;
+	editorDrawRows(&ab);
+	abFree(&ab);
+    }
+    benchReport("draw_rows", frames, benchNow() - start, 0);
+
+    E.wrap = 1;
+    E.screencols = 40;
+    long long lines_total = rowIndexTotal(editorWrapIndex());
+    start = benchNow();
+    for(j = 0; j < frames; j++) {
+	struct abuf ab = ABUF_INIT;
+	E.rowoff = (long long) j * E.screenrows % lines_total;
+	editorDrawRows(&ab);
+	abFree(&ab);
+    }
+    benchReport("draw_rows/wrap", frames, benchNow() - start, 0);
+}
+
+int main(int argc, char *argv[]) {
+    int scale = argc > 1 ? atoi(argv[1]) : 1;
+    if(scale < 1) scale = 1;
+
+    benchInsertRow(scale);
+    benchLongLine(scale);
+    benchCommentCascade(scale);
+    benchTabs(scale);
+    benchFollow(scale);
+    benchOpen(scale);
+    benchSort(scale);
+    benchServe(scale);
+    benchSave(scale);
+    benchHex(scale);
+    benchBracketMatch(scale);
+    benchDrawRows(scale);
+    return 0;
+}
@@ -0,0 +1,119 @@
+/*** reference highlighter ***/
+// The hand-written highlighter kilo used before syntax definitions were
+// compiled into lexer tables. It is kept here as the baseline for the
+// benchmarks and as the model the table driven lexer has to agree with.
+// Include after kilo.c
+
+void referenceUpdateSyntax(erow *row) {
+    row->hl = realloc(row->hl, row->rsize);
+    // An empty row may have no hl at all
+    if(row->rsize) memset(row->hl, HL_NORMAL, row->rsize);
+
+    if(E.syntax == NULL) return;
+
+    char **keywords = E.syntax->keywords;
+
+    char *scs = E.syntax->singleline_comment_start;
+    char *mcs = E.syntax->multiline_comment_start;
+    char *mce = E.syntax->multiline_comment_end;
+    int scs_len = scs ? strlen(scs) : 0;
+    int mcs_len = mcs ? strlen(mcs) : 0;
+    int mce_len = mce ? strlen(mce) : 0;
+
+    int prev_sep = 1;
+    int in_string = 0;
+    int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+
+    int i = 0;
+    while (i < row->rsize) {
+	char c = row->render[i];
+	unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+
+	if(scs_len && !in_string && !in_comment) {
+	    if(!strncmp(&row->render[i], scs, scs_len)) {
+		memset(&row->hl[i], HL_COMMENT, row->rsize - i);
+		break;
+	    }
+	}
+
+	if(mcs_len && mce_len && !in_string) {
+	    if(in_comment) {
+		row->hl[i] = HL_MLCOMMENT;
+		if(!strncmp(&row->render[i], mce, mce_len)) {
+		    memset(&row->hl[i], HL_MLCOMMENT, mce_len);
+		    i += mce_len;
+		    in_comment = 0;
+		    prev_sep = 1;
+		    continue;
+		} else {
+		    i++;
+		    continue;
+		} 
+	    } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
+		    memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
+		    i += mcs_len;
+		    in_comment = 1;
+		    continue;
+	    }
+	}
+
+	if(E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
+	    if(in_string) {
+		row->hl[i] = HL_STRING;
+		if (c == '\\' && i + 1 < row->rsize) {
+		    row->hl[i +1] = HL_STRING;
+		    i += 2;
+		    continue;
+		}
+		if(c == in_string) in_string = 0;
+		i++;
+		prev_sep = 1;
+		continue;
+	    } else {
+		if(c == '"' || c == '\'') {
+		    in_string = c;
+		    row->hl[i] = HL_STRING;
+		    i++;
+		    continue;
+		}
+	    }
+	}
+	
+	if(E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
+	    if((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
+		(c == '.' && prev_hl == HL_NUMBER)) {
+		row->hl[i] = HL_NUMBER;
+		i++;
+		prev_sep = 0;
+		continue;
+	    }
+	}
+
+	if(prev_sep) {
+	    int j;
+	    for(j = 0; keywords[j]; j++) {
+		int klen = strlen(keywords[j]);
+		int kw2 = keywords[j][klen - 1] == '|';
+		if(kw2) klen--;
+
+		if(!strncmp(&row->render[i], keywords[j], klen) &&
+			is_separator(row->render[i + klen])) {
+		    memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
+		    i += klen;
+		    break;
+		}
+	    }
+	    if(keywords[j] != NULL) {
+		prev_sep = 0;
+		continue;
+	    }
+	}
+	prev_sep = is_separator(c);
+	i++;
+    }
+
+    int changed = (row->hl_open_comment != in_comment);
+    row->hl_open_comment = in_comment;
+    if(changed && row->idx + 1 < E.numrows)
+	referenceUpdateSyntax(&E.row[row->idx + 1]);
+}
@@ -0,0 +1,80 @@
+/*** includes ***/
+#define KILO_NO_MAIN
+#include "../kilo.c"
+#include "reference.h"
+
+/*** syntax benchmark ***/
+// Times the table driven lexer against the old hand-written highlighter on
+// a synthetic C buffer and reports throughput in MB/s.
+//   ./syntaxbench [rows] [passes]
+
+char *bench_lines[] = {
+    "int main(int argc, char *argv[]) {",
+    "\tfor(int i = 0; i < 1024; i++) total += values[i] * 3.25;",
+    "\tprintf(\"%d items, \\\"quoted\\\" %s\\n\", count, name);",
+    "    // a single line comment with if while return inside",
+    "/* a multi-line comment that opens here",
+    "   keeps going with struct union typedef 0x1234",
+    "   and closes here */ static unsigned long mask = 0xff;",
+    "\tswitch(c) { case 'a': return 1; default: break; }",
+    "",
+    "typedef struct erow { int idx; double weight; char *chars; } erow;",
+};
+
+#define BENCH_LINES (sizeof(bench_lines) / sizeof(bench_lines[0]))
+
+double benchNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double benchHighlight(void (*highlight)(erow *), int passes) {
+    double start = benchNow();
+    for(int p = 0; p < passes; p++)
+	for(int j = 0; j < E.numrows; j++)
+	    highlight(&E.row[j]);
+    return benchNow() - start;
+}
+
+int main(int argc, char *argv[]) {
+    int rows = argc > 1 ? atoi(argv[1]) : 200000;
+    int passes = argc > 2 ? atoi(argv[2]) : 5;
+
+    initBuffer();
+    E.screenrows = 24;
+    E.screencols = 80;
+    E.filename = strdup("bench.c");
+    editorSelectSyntaxHighlight();
+    for(int j = 0; j < rows; j++) {
+	char *s = bench_lines[j % BENCH_LINES];
+	editorInsertRow(E.numrows, s, strlen(s));
+    }
+
+    long bytes = 0;
+    for(int j = 0; j < E.numrows; j++) bytes += E.row[j].rsize;
+
+    // Both have to agree before their speed means anything
+    unsigned char **expect = malloc(sizeof(unsigned char *) * E.numrows);
+    for(int j = 0; j < E.numrows; j++) referenceUpdateSyntax(&E.row[j]);
+    for(int j = 0; j < E.numrows; j++) {
+	expect[j] = malloc(E.row[j].rsize + 1);
+	memcpy(expect[j], E.row[j].hl, E.row[j].rsize);
+    }
+    for(int j = 0; j < E.numrows; j++) editorUpdateSyntax(&E.row[j]);
+    for(int j = 0; j < E.numrows; j++) {
+	if(memcmp(expect[j], E.row[j].hl, E.row[j].rsize)) {
+	    fprintf(stderr, "highlight mismatch on row %d: %s\n", j,
+		    E.row[j].render);
+	    return 1;
+	}
+    }
+
+    double mb = (double) bytes * passes / (1024 * 1024);
+    double tref = benchHighlight(referenceUpdateSyntax, passes);
+    double ttab = benchHighlight(editorUpdateSyntax, passes);
+    printf("%d rows, %.1f MB highlighted per run\n", E.numrows, mb);
+    printf("hand-written  %8.3f s %8.1f MB/s\n", tref, mb / tref);
+    printf("table driven  %8.3f s %8.1f MB/s\n", ttab, mb / ttab);
+    return 0;
+}
@@ -4,14 +4,26 @@
 #define _GNU_SOURCE
 
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 #include <termios.h>
@@ -21,6 +33,21 @@
 #define KILO_VERSION "0.0.1"
 #define KILO_TAB_STOP 4
 #define KILO_QUIT_TIMES 3
+#define KILO_STATUS_TIMEOUT 5 // Seconds a status message stays up
+#define KILO_ESC_TIMEOUT 100 // Milliseconds to wait for the rest of an escape sequence
+#define KILO_UNDO_STEPS 1000
+#define KILO_PIPE_CHUNK 65536 // Bytes read from a child at a time
+#define KILO_PIPE_IOV 1024 // Buffers per writev
+#define KILO_PIPE_MAX (256 << 20) // Bytes of rows a filter can send back before it's cancelled
+#define KILO_PROGRESS_INTERVAL 100 // Milliseconds between progress updates
+#define KILO_DIFF_MAX 1024 // Changed lines past which a reload stops diffing
+#define KILO_SESSION_MAGIC "kilo-ss2" // First bytes of a session cache entry
+#define KILO_SORT_THREADS 8 // Most threads a sort runs on
+#define KILO_SORT_MIN_ROWS 65536 // Fewest rows worth a thread of their own
+#define KILO_HEX_WIDTH 16 // Bytes per line of the hex view
+#define KILO_HEX_SNIFF 8192 // Bytes checked for a NUL to tell a binary file
+#define KILO_CLIENT_BACKLOG (1 << 20) // Bytes a client can leave unread before it's dropped
+#define KILO_INDEX_BLOCK 256 // Most rows a block of a row index holds
 #define CTRL_KEY(k) ((k) & 0x1f)
 enum editorKey {
     BACKSPACE = 127,
@@ -32,7 +59,12 @@ enum editorKey {
     HOME_KEY,
     END_KEY,
     PAGE_UP,
-    PAGE_DOWN
+    PAGE_DOWN,
+    // Not keys, editorReadKey returns these when it wakes up for something
+    // other than input so the screen can be redrawn
+    RESIZE_EVENT,
+    TIMER_EVENT,
+    FILE_EVENT
 };
 
 // hl is array of unsigned char in the range of 0 to 255
@@ -53,7 +85,69 @@ enum editorHilight {
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
 
+// A syntax gets compiled into a state transition table indexed by the
+// current lexer state and the class of the next byte. The states stand in
+// for the prev_sep, prev_hl, in_string and in_comment flags the highlighter
+// used to recheck on every character
+enum lexState {
+    LEX_SEP = 0, // After a separator, numbers and keywords can start here
+    LEX_WORD,
+    LEX_NUM, // Digits and '.' keep extending the number
+    LEX_DQUOTE,
+    LEX_SQUOTE,
+    LEX_MLCOMMENT,
+    LEX_STATES
+};
+
+// Properties of a byte, all bytes with the same set share one class
+#define LEXP_SEP (1<<0)
+#define LEXP_DIGIT (1<<1)
+#define LEXP_DOT (1<<2)
+#define LEXP_DQUOTE (1<<3)
+#define LEXP_SQUOTE (1<<4)
+#define LEXP_ESCAPE (1<<5)
+#define LEXP_SCS (1<<6)
+#define LEXP_MCS (1<<7)
+#define LEXP_MCE (1<<8)
+#define LEXP_KEYWORD (1<<9)
+
+// Matches that need to look past the current byte, tried in this order
+// before taking the plain transition
+#define LEX_TRY_SCS (1<<0)
+#define LEX_TRY_MCS (1<<1)
+#define LEX_TRY_MCE (1<<2)
+#define LEX_TRY_ESCAPE (1<<3)
+#define LEX_TRY_KEYWORD (1<<4)
+
 /*** data ***/
+struct lexTrans {
+    unsigned char tries;
+    unsigned char hl; // Highlight of the byte when none of the tries match
+    unsigned char next;
+};
+
+struct lexKeyword {
+    char *s;
+    int len;
+    unsigned char hl;
+};
+
+struct editorLexer {
+    unsigned char cls[256]; // Byte to class
+    unsigned char sep[256]; // is_separator() of every byte
+    int nclasses;
+    struct lexTrans *table; // table[state * nclasses + class]
+    struct lexKeyword *kw; // Keywords bucketed by their first byte
+    int kwstart[256];
+    int kwcount[256];
+    char *scs;
+    char *mcs;
+    char *mce;
+    int scs_len;
+    int mcs_len;
+    int mce_len;
+};
+
 struct editorSyntax {
     char *filetype;
     char **filematch;
@@ -62,6 +156,25 @@ struct editorSyntax {
     char *multiline_comment_start;
     char *multiline_comment_end;
     int flags;
+    struct editorLexer *lexer; // Compiled the first time the syntax is used
+};
+
+// A compressed file format, recognised by its extension and read and
+// written through external commands
+struct editorCodec {
+    char *ext;
+    char *decompress;
+    char *compress;
+};
+
+#define KILO_BRACKET_TYPES 3 // (), [] and {}
+
+// Bracket depth of a row, or of a run of rows, for every bracket type. net
+// is opens minus closes and min the lowest that count gets going left to
+// right, so d unmatched opens are closed inside the run when d + min <= 0
+struct bracketSum {
+    int net[KILO_BRACKET_TYPES];
+    int min[KILO_BRACKET_TYPES];
 };
 
 typedef struct erow {
@@ -73,9 +186,157 @@ typedef struct erow {
     unsigned char *hl; // For figuring out the hilighting for each row of text
     // it's displayed, this stores the hilighting for each line in the array
     int hl_open_comment;
+    struct bracketSum brackets; // Brackets outside strings and comments
+    int brackets_stale; // Highlighted again since they were counted
 } erow; // Strands for editor row and stores a line of text as a pointer to
 // to the dynamically allocated character data and a length.
 
+// Consecutive rows of a row index
+struct rowBlock {
+    int *val; // Measure of each row, room for KILO_INDEX_BLOCK
+    int n;
+    long long sum;
+};
+
+// Some per-row measure (visual lines, bytes) kept in blocks of rows, with
+// Fenwick trees over the blocks' sums and row counts. Prefix sums and
+// "which row holds position n" are O(log n) plus a block, and so is a row
+// going in or out anywhere in the buffer
+struct rowIndex {
+    struct rowBlock *blocks;
+    int nblocks;
+    int capblocks;
+    long long *sums; // Fenwick tree of the blocks' sums, 1-based
+    int *counts; // Fenwick tree of the blocks' rows, 1-based
+    int n;
+    int stale; // Rebuilt from the rows on the next query
+    int (*measure)(struct rowIndex *ix, erow *row);
+    int cols; // Screen width a wrap index counts visual lines at
+};
+
+// Segment tree of the rows' bracket sums, to find the row holding a
+// matching bracket in O(log n). The leaves no row uses sit together in a
+// gap that moves to wherever rows go in or out, so an edit only combines
+// the nodes above the leaves it moved. Highlighted rows are only counted
+// again when it is queried
+struct bracketIndex {
+    struct bracketSum *tree; // Node i has children 2i and 2i + 1
+    int size; // Leaves, see bracketLeaf for the one of a row
+    int n;
+    int gap; // Row the free leaves sit before
+    int stale;
+    int *dirty; // Rows highlighted since the last query
+    int ndirty;
+    int capdirty;
+};
+
+// Undoing a step puts the saved rows back in place of the newn rows the
+// change left at row at. Steps that only rewrote rows in place keep the
+// index of every saved row in idx instead
+struct undoStep {
+    int at;
+    int oldn; // Rows saved
+    int newn;
+    int *idx; // Ascending
+    int *perm; // For sorts, where each of the newn rows came from, then the rest
+    erow *rows; // Only chars and size are kept
+    int cx, cy; // Cursor before the change
+    int typing; // Typing on the same rows keeps adding to the step
+};
+
+// A child process rows are streamed to and read back from. Either end can
+// be a file instead of a pipe, in which case in or out is -1 from the start
+struct pipeJob {
+    pid_t pid;
+    int in; // Child's stdin
+    int out; // Child's stdout
+    int row; // Next row to write
+    int endrow;
+    int off; // Bytes of the row already written, size means only the newline
+    erow *rows; // Rows read back
+    int nrows;
+    int caprows;
+    char *partial; // Line read without its newline yet
+    int plen;
+    int pcap;
+    long long written;
+    long long total;
+    long long got; // Memory the rows read back take
+    long long max; // Cancelled once got goes over it, 0 for no limit
+    int start; // First row written
+    int fd; // File the child reads or writes, for done to close
+    const char *what; // Shown with the progress
+    long long last; // When the progress was last shown
+    int failed;
+    void (*done)(struct pipeJob *job, int status); // Once the child is gone
+    void *data;
+};
+
+struct cursor {
+    int cx;
+    int cy;
+};
+
+// A question in the message bar, answered by the keys of the view it's up
+// in while the editor carries on with everything else. A text prompt hands
+// the line typed to done, a key prompt gives keys to key until it returns 1
+struct editorPrompt {
+    const char *fmt; // With a %s for the text typed so far
+    int empty; // Enter takes an empty line as well
+    char *buf;
+    size_t len;
+    size_t cap;
+    void (*callback)(char *, int); // Sees every key of a text prompt
+    void (*done)(char *, void *); // Gets the text, NULL when cancelled
+    int (*key)(int, void *);
+    void *data; // Handed to done and key
+    char question[80]; // What a key prompt asks
+    // A search draws its match highlighted and goes back to where it
+    // started when cancelled
+    long long match; // Row, or offset in the hex view, -1 for none
+    int matchrx;
+    int matchlen;
+    int cx, cy, rowoff, coloff;
+    long long hexcur, hextop;
+};
+
+// Where one client of a server is in the buffer, swapped in and out of E
+struct editorView {
+    int cx, cy;
+    int rowoff;
+    int coloff;
+    int screenrows;
+    int screencols;
+    int wrap;
+    int markx, marky;
+    struct cursor *cursors;
+    int ncursors;
+    int capcursors;
+    int primary;
+    long long hexcur;
+    long long hextop;
+    char statusmsg[80];
+    time_t statusmsg_time;
+    int quit_times;
+    struct editorPrompt *prompt;
+    struct pipeJob *pipe;
+};
+
+// A terminal attached to a server. lines is the last frame it was sent,
+// one string per screen line, so only the lines that changed go out again
+struct editorClient {
+    int fd;
+    int gone; // Hung up or quit, dropped once its keys are handled
+    struct editorView view;
+    char **lines;
+    int *lens;
+    int nlines;
+    int cols;
+    char cursor[32]; // Where the last frame left the cursor
+    char *out; // Frames the socket didn't take yet
+    int outlen;
+};
+
 struct editorConfig {
     struct termios orig_termios;
     int cx, cy; // Cursor x and y positions
@@ -91,6 +352,50 @@ struct editorConfig {
     char statusmsg[80];
     time_t statusmsg_time;
     struct editorSyntax *syntax;
+    int wrap; // Soft wrap, rowoff counts visual lines instead of rows
+    struct rowIndex **wraps; // Visual lines per row, one for each width, see editorWrapIndex
+    int nwraps;
+    struct rowIndex byteindex; // Bytes per row including the newline
+    struct bracketIndex brackets;
+    struct undoStep *undo;
+    int undolen;
+    int markx, marky; // Other end of the region, marky is -1 without a mark
+    char *clip; // Clipboard, rows joined by newlines
+    size_t cliplen;
+    struct cursor *cursors; // Every cursor when there are several, in order
+    int ncursors; // 0 with a single cursor
+    int capcursors;
+    int primary; // The one E.cx and E.cy follow
+    int quit_times; // Ctrl-Qs left before quitting with unsaved changes
+    struct editorPrompt *prompt; // Up in the message bar, NULL for none
+    struct pipeJob *pipe; // Running for a client of the server, see pipeStart
+    int wakefd[2]; // Self-pipe that signal handlers write to
+    int watchfd; // inotify on the file's directory, -1 without a file
+    int diskchanged; // The watch fired, see editorCheckDisk
+    struct stat disk; // The file as we last read or wrote it
+    off_t tailoff; // Bytes of the file the buffer was read from
+    int tailpartial; // Those bytes didn't end in a newline
+    unsigned long long *diskhash; // Of every line of the file, NULL when unknown
+    int disklines;
+    int diskexact; // Writing the rows out gives back the file byte for byte
+    int changelo; // Rows before it are the file's first lines, -1 for none changed
+    int changetail; // and this many at the end are its last lines
+    int follow; // Keep reading what gets appended to the file
+    int followmax; // Rows follow mode keeps, 0 for all of them
+    long long evicted; // Rows follow mode dropped, the buffer isn't the whole file
+    int hex; // Showing the file as a hex dump instead of rows, see editorOpenHex
+    int hexopen; // Open files in the hex view whatever they hold
+    unsigned char *hexmap; // The file mapped read-only, NULL when it is empty
+    long long hexsize;
+    long long hexcur; // Offset of the byte under the cursor
+    long long hextop; // Offset of the first line on the screen
+    volatile sig_atomic_t resized; // Set by SIGWINCH, see editorRelayout
+    int infd; // Keys are read from here, a client's socket in server mode
+    int outfd; // and frames written here
+    struct editorClient *clients; // Terminals attached to this server
+    int nclients;
+    int current; // Client whose view E holds, -1 for none
+    char *socketpath; // Removed when the server exits
 };
 
 struct editorConfig E;
@@ -104,23 +409,87 @@ char *C_HL_keywords[] = {
   "void|", NULL
 };
 
-struct editorSyntax HLDB[] = {
+struct editorSyntax HLDB_BUILTIN[] = {
     {
 	"c",
 	C_HL_extensions,
 	C_HL_keywords,
 	"//", "/*", "*/",
-	HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+	HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+	NULL
     },
 };
 
-#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
+#define HLDB_BUILTIN_ENTRIES (sizeof(HLDB_BUILTIN) / sizeof(HLDB_BUILTIN[0]))
+
+struct editorCodec CODECS[] = {
+    {".gz", "gzip -dc", "gzip -c"},
+    {".zst", "zstd -dcq", "zstd -cq"},
+    {".bz2", "bzip2 -dc", "bzip2 -c"},
+    {".xz", "xz -dc", "xz -c"},
+};
+
+#define CODECS_ENTRIES (sizeof(CODECS) / sizeof(CODECS[0]))
+
+struct editorCodec *editorFileCodec(const char *filename) {
+    if(filename == NULL) return NULL;
+    size_t len = strlen(filename);
+    unsigned int j;
+    for(j = 0; j < CODECS_ENTRIES; j++) {
+	size_t elen = strlen(CODECS[j].ext);
+	if(len > elen && !strcmp(&filename[len - elen], CODECS[j].ext))
+	    return &CODECS[j];
+    }
+    return NULL;
+}
+
+// Definitions loaded from the syntax directory come first so that they can
+// override the builtin ones
+struct editorSyntax *HLDB = HLDB_BUILTIN;
+unsigned int HLDB_ENTRIES = HLDB_BUILTIN_ENTRIES;
 
 /*** prototypes ***/
 
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
-char *editorPrompt(char *prompt, void (*callback) (char *, int));
+void editorPrompt(const char *fmt, void (*callback)(char *, int),
+	void (*done)(char *, void *), void *data);
+void editorAsk(int (*key)(int, void *), void *data, const char *fmt, ...);
+void editorPromptKey(int c);
+void editorPromptEnd();
+int editorWaitEvent();
+int editorReadByte(char *c, int timeout);
+void editorClampCursor();
+void editorWatchFile();
+void editorRowBrackets(erow *row);
+void editorOpenCompressed(struct editorCodec *codec);
+void editorSaveCompressed(struct editorCodec *codec);
+void pipeEnd(int cancel);
+struct pipeJob *editorClientPipe(int k);
+struct pipeJob *editorBusy();
+int pipeWriteRows(struct pipeJob *job);
+void editorFollowRead();
+void editorFollowEvict();
+void editorSessionLoad(erow *rows, int n, struct stat *st);
+void editorSessionSave();
+int editorIsBinary(const char *filename);
+void editorOpenHex(char *filename);
+void editorHexGoto(long long off);
+void editorResize(int rows, int cols);
+void editorSendFrame(const char *body, int len, const char *cursor);
+void editorFlushClient(struct editorClient *c);
+unsigned long long editorRowHash(erow *row);
+void editorMarkChanged(int at, int n);
+void editorMarkRows(int *idx, int n);
+void editorNarrowChanges();
+void editorDiskSnapshot();
+void editorDiskSaved();
+void editorDiskForget();
+void editorDiskAppend(int n);
+void editorDiskJoinLast();
+void editorKeepChanges();
+void editorSave();
+void editorAddCursorsDone();
 
 /*** terminal ***/
 
@@ -163,27 +532,59 @@ void enableRawMode() {
     raw.c_cc[VMIN] = 0;
     // Sets minimum number of bytes of input needed before read returns
     // 0 so that read returns as soon as there is any input to be read
-    raw.c_cc[VTIME] = 1;
-    // VTIME sets maximum time to wait before 
-    // read returns in 1/10th of a second if read times
-    // out it will return 0
+    raw.c_cc[VTIME] = 0;
+    // VTIME sets maximum time to wait before read returns, we don't let
+    // read wait at all and block in poll instead (see editorWaitEvent)
+    // so that an idle editor doesn't wake up 10 times a second
     if(tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
 	die("tcsetattr");
     // Write new term attributes out
 }
 
+// Rest of a "\x1b[8;rows;colst" window size report, which is how the
+// clients of a server tell it the size of their terminal
+int editorReadWindowSize() {
+    int n[2] = {0, 0}, k = 0;
+    char c;
+    while (editorReadByte(&c, KILO_ESC_TIMEOUT)) {
+	if(c >= '0' && c <= '9' && n[k] < 10000) {
+	    n[k] = n[k] * 10 + c - '0';
+	} else if(c == ';' && k == 0) {
+	    k = 1;
+	} else if(c == 't' && k == 1) {
+	    editorResize(n[0], n[1]);
+	    return RESIZE_EVENT;
+	} else {
+	    break;
+	}
+    }
+    return '\x1b';
+}
+
 int editorReadKey() {
     int nread;
     char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-	if(nread == -1 && errno != EAGAIN) die("read");
+    while (1) {
+	int event = editorWaitEvent();
+	if(event) return event;
+	if((nread = read(E.infd, &c, 1)) == 1) break;
+	if(nread == -1 && (errno == EAGAIN || errno == EINTR)) continue;
+	// poll reports a hung up terminal as readable and read returns 0. A
+	// client of a server hanging up only cancels what it was doing
+	if(E.current != -1) {
+	    E.clients[E.current].gone = 1;
+	    return '\x1b';
+	}
+	die("read");
     }
 
     if(c =='\x1b') {
 	char seq[3];
 
-	if(read(STDIN_FILENO, &seq[0], 1) !=1) return '\x1b';
-	if(read(STDIN_FILENO, &seq[1], 1) !=1) return '\x1b';
+	// The rest of the sequence follows right away, a lone escape
+	// doesn't
+	if(!editorReadByte(&seq[0], KILO_ESC_TIMEOUT)) return '\x1b';
+	if(!editorReadByte(&seq[1], KILO_ESC_TIMEOUT)) return '\x1b';
 	
 	// PUP and PDOWN are [5~ and [6~ hence we needed seq to store 3 bytes
 	// Home and End keys have many escape sequences depending on OS
@@ -192,7 +593,8 @@ int editorReadKey() {
 	// Delete key returns [3~
 	if(seq[0] == '[') {
 	    if(seq[1] >= '0' && seq[1] <= '9') {
-		if(read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
+		if(!editorReadByte(&seq[2], KILO_ESC_TIMEOUT)) return '\x1b';
+		if(seq[1] == '8' && seq[2] == ';') return editorReadWindowSize();
 		if(seq[2] == '~') {
 		    switch (seq[1]) {
 			case '1': return HOME_KEY;
@@ -236,7 +638,7 @@ int getcursorPosition(int *rows, int *cols) {
 
     // Process the reply
     while (i < sizeof(buf) - 1) {
-	if(read(STDIN_FILENO, &buf[i], 1) != 1) break;
+	if(!editorReadByte(&buf[i], KILO_ESC_TIMEOUT)) break;
 	if(buf[i] == 'R') break;
 	i++;
     }
@@ -264,123 +666,352 @@ int getWindowSize(int *rows, int*cols) {
 	return 0;
     }
 }
+/*** event loop ***/
+
+void editorSigwinchHandler(int sig) {
+    (void) sig;
+    int saved_errno = errno;
+    // Only flag the resize and wake up the event loop, the relayout happens
+    // on the next redraw so that the handler never blocks whatever the
+    // editor is in the middle of. If the pipe is full a wakeup is already
+    // pending
+    E.resized = 1;
+    write(E.wakefd[1], "w", 1);
+    errno = saved_errno;
+}
+
+void editorInitEvents() {
+    if(pipe(E.wakefd) == -1) die("pipe");
+    fcntl(E.wakefd[0], F_SETFL, O_NONBLOCK);
+    fcntl(E.wakefd[1], F_SETFL, O_NONBLOCK);
+    fcntl(E.wakefd[0], F_SETFD, FD_CLOEXEC);
+    fcntl(E.wakefd[1], F_SETFD, FD_CLOEXEC);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = editorSigwinchHandler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    if(sigaction(SIGWINCH, &sa, NULL) == -1) die("sigaction");
+    // A child that stops reading its input should give us EPIPE rather
+    // than kill the editor
+    sa.sa_handler = SIG_IGN;
+    if(sigaction(SIGPIPE, &sa, NULL) == -1) die("sigaction");
+}
+
+// Milliseconds until the next timer is due, -1 when there is none so that
+// poll can sleep until there is input
+int editorNextTimeout() {
+    if(E.statusmsg[0] == '\0') return -1;
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    long long due = (long long) (E.statusmsg_time + KILO_STATUS_TIMEOUT) * 1000;
+    long long left = due - ((long long) now.tv_sec * 1000 + now.tv_nsec / 1000000);
+    // Once the message has expired and been cleared there is nothing to
+    // wait for
+    if(left <= 0) return -1;
+    return left;
+}
+
+// Blocks until a key can be read, the terminal was resized, the file
+// changed on disk or a timer is due. Returns 0 when stdin is readable, or
+// the event otherwise
+int editorWaitEvent() {
+    while (1) {
+	struct pollfd fds[3];
+	fds[0].fd = E.infd;
+	fds[0].events = POLLIN;
+	fds[1].fd = E.wakefd[0];
+	fds[1].events = POLLIN;
+	// Polling a negative fd is a no-op
+	fds[2].fd = E.watchfd;
+	fds[2].events = POLLIN;
+
+	int n = poll(fds, 3, editorNextTimeout());
+	if(n == -1) {
+	    if(errno == EINTR) continue;
+	    die("poll");
+	}
+	if(n == 0) return TIMER_EVENT;
+	if(fds[1].revents & POLLIN) {
+	    char buf[64];
+	    while (read(E.wakefd[0], buf, sizeof(buf)) > 0);
+	    return RESIZE_EVENT;
+	}
+	if(fds[2].revents & POLLIN) {
+	    // Which events they were doesn't matter, editorCheckDisk compares
+	    // the file with what we know about it
+	    char buf[4096];
+	    while (read(E.watchfd, buf, sizeof(buf)) > 0);
+	    E.diskchanged = 1;
+	    return FILE_EVENT;
+	}
+	if(fds[0].revents & (POLLIN | POLLHUP | POLLERR)) return 0;
+    }
+}
+
+// Reads one byte, giving up after timeout milliseconds. A client of a
+// server sends the whole of a key's sequence at once, and waiting for the
+// rest of a lone escape would hold up every other client
+int editorReadByte(char *c, int timeout) {
+    if(E.current != -1) timeout = 0;
+    struct pollfd pfd;
+    pfd.fd = E.infd;
+    pfd.events = POLLIN;
+    if(poll(&pfd, 1, timeout) != 1) return 0;
+    return read(E.infd, c, 1) == 1;
+}
+
 /*** syntax hilighting ***/
 int is_separator(int c) {
     // strchr returns pointer to matching character in string else returns NULL
     return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
 }
 
-void editorUpdateSyntax(erow *row) {
-    row->hl = realloc(row->hl, row->rsize);
-    memset(row->hl, HL_NORMAL, row->rsize);
+// Works out the transition out of a lexer state for a byte class, following
+// the same order of checks the hand-written highlighter used
+struct lexTrans lexTransition(int state, int props) {
+    struct lexTrans t = {0, HL_NORMAL, LEX_SEP};
+
+    if(state == LEX_MLCOMMENT) {
+	t.hl = HL_MLCOMMENT;
+	t.next = LEX_MLCOMMENT;
+	if(props & LEXP_MCE) t.tries = LEX_TRY_MCE;
+	return t;
+    }
+
+    if(state == LEX_DQUOTE || state == LEX_SQUOTE) {
+	int quote = (state == LEX_DQUOTE) ? LEXP_DQUOTE : LEXP_SQUOTE;
+	t.hl = HL_STRING;
+	t.next = state;
+	if(props & LEXP_ESCAPE) t.tries = LEX_TRY_ESCAPE;
+	else if(props & quote) t.next = LEX_SEP;
+	return t;
+    }
 
-    if(E.syntax == NULL) return;
+    if(props & LEXP_SCS) t.tries |= LEX_TRY_SCS;
+    if(props & LEXP_MCS) t.tries |= LEX_TRY_MCS;
 
-    char **keywords = E.syntax->keywords;
+    if(props & LEXP_DQUOTE) {
+	t.hl = HL_STRING;
+	t.next = LEX_DQUOTE;
+    } else if(props & LEXP_SQUOTE) {
+	t.hl = HL_STRING;
+	t.next = LEX_SQUOTE;
+    } else if(((props & LEXP_DIGIT) && state != LEX_WORD) ||
+	    ((props & LEXP_DOT) && state == LEX_NUM)) {
+	t.hl = HL_NUMBER;
+	t.next = LEX_NUM;
+    } else {
+	if((props & LEXP_KEYWORD) && state == LEX_SEP)
+	    t.tries |= LEX_TRY_KEYWORD;
+	t.next = (props & LEXP_SEP) ? LEX_SEP : LEX_WORD;
+    }
+    return t;
+}
+
+struct editorLexer *editorCompileSyntax(struct editorSyntax *s) {
+    struct editorLexer *L = calloc(1, sizeof(struct editorLexer));
+
+    L->scs = s->singleline_comment_start;
+    L->mcs = s->multiline_comment_start;
+    L->mce = s->multiline_comment_end;
+    L->scs_len = L->scs ? strlen(L->scs) : 0;
+    L->mcs_len = L->mcs ? strlen(L->mcs) : 0;
+    L->mce_len = L->mce ? strlen(L->mce) : 0;
+    // Multi-line comments only count when both delimiters are there
+    if(!L->mcs_len || !L->mce_len) L->mcs_len = L->mce_len = 0;
+
+    // Bucket keywords by first byte keeping their order in the list, since
+    // the first keyword that matches wins
+    int nkw = 0;
+    while (s->keywords && s->keywords[nkw]) nkw++;
+    L->kw = malloc(sizeof(struct lexKeyword) * (nkw ? nkw : 1));
+    int j;
+    for(j = 0; j < nkw; j++)
+	if(s->keywords[j][0] != '|')
+	    L->kwcount[(unsigned char) s->keywords[j][0]]++;
+    int fill[256];
+    int c, total = 0;
+    for(c = 0; c < 256; c++) {
+	L->kwstart[c] = fill[c] = total;
+	total += L->kwcount[c];
+    }
+    for(j = 0; j < nkw; j++) {
+	char *k = s->keywords[j];
+	if(k[0] == '|') continue;
+	int klen = strlen(k);
+	int kw2 = k[klen - 1] == '|';
+	struct lexKeyword *kw = &L->kw[fill[(unsigned char) k[0]]++];
+	kw->s = k;
+	kw->len = kw2 ? klen - 1 : klen;
+	kw->hl = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+    }
+
+    // Bytes with the same properties behave the same in every state so
+    // they share a column of the table
+    int classprops[256];
+    for(c = 0; c < 256; c++) {
+	int props = 0;
+	L->sep[c] = is_separator(c);
+	if(L->sep[c]) props |= LEXP_SEP;
+	if(s->flags & HL_HIGHLIGHT_NUMBERS) {
+	    if(isdigit(c)) props |= LEXP_DIGIT;
+	    if(c == '.') props |= LEXP_DOT;
+	}
+	if(s->flags & HL_HIGHLIGHT_STRINGS) {
+	    if(c == '"') props |= LEXP_DQUOTE;
+	    if(c == '\'') props |= LEXP_SQUOTE;
+	    if(c == '\\') props |= LEXP_ESCAPE;
+	}
+	if(L->scs_len && c == (unsigned char) L->scs[0]) props |= LEXP_SCS;
+	if(L->mcs_len && c == (unsigned char) L->mcs[0]) props |= LEXP_MCS;
+	if(L->mce_len && c == (unsigned char) L->mce[0]) props |= LEXP_MCE;
+	if(L->kwcount[c]) props |= LEXP_KEYWORD;
+
+	int k;
+	for(k = 0; k < L->nclasses; k++)
+	    if(classprops[k] == props) break;
+	if(k == L->nclasses) classprops[L->nclasses++] = props;
+	L->cls[c] = k;
+    }
+
+    L->table = malloc(sizeof(struct lexTrans) * LEX_STATES * L->nclasses);
+    int state;
+    for(state = 0; state < LEX_STATES; state++)
+	for(j = 0; j < L->nclasses; j++)
+	    L->table[state * L->nclasses + j] = lexTransition(state, classprops[j]);
+    return L;
+}
 
-    char *scs = E.syntax->singleline_comment_start;
-    char *mcs = E.syntax->multiline_comment_start;
-    char *mce = E.syntax->multiline_comment_end;
-    int scs_len = scs ? strlen(scs) : 0;
-    int mcs_len = mcs ? strlen(mcs) : 0;
-    int mce_len = mce ? strlen(mce) : 0;
+struct lexKeyword *lexMatchKeyword(struct editorLexer *L, char *render,
+	int at, int len) {
+    unsigned char c = render[at];
+    int k, end = L->kwstart[c] + L->kwcount[c];
+    for(k = L->kwstart[c]; k < end; k++) {
+	struct lexKeyword *kw = &L->kw[k];
+	// render is nul terminated so the byte after a keyword that ends the
+	// row reads as a separator
+	if(at + kw->len <= len && !memcmp(&render[at], kw->s, kw->len) &&
+		L->sep[(unsigned char) render[at + kw->len]])
+	    return kw;
+    }
+    return NULL;
+}
 
-    int prev_sep = 1;
-    int in_string = 0;
-    int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+// Lexes a row into hl, which has room for rsize bytes, starting from the
+// comment state the row above left. Returns whether a multi-line comment is
+// still open at its end
+int editorLexRow(erow *row, unsigned char *hl) {
+    // Every byte is looked up in the transition table of the current
+    // state, only bytes that can start a comment, an escape or a keyword
+    // need to look further ahead
+    struct editorLexer *L = E.syntax->lexer;
+    char *render = row->render;
+    int n = row->rsize;
+    int state = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment) ?
+	LEX_MLCOMMENT : LEX_SEP;
 
     int i = 0;
-    while (i < row->rsize) {
-	char c = row->render[i];
-	unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+    while (i < n) {
+	struct lexTrans *t = &L->table[state * L->nclasses +
+	    L->cls[(unsigned char) render[i]]];
 
-	if(scs_len && !in_string && !in_comment) {
-	    if(!strncmp(&row->render[i], scs, scs_len)) {
-		memset(&row->hl[i], HL_COMMENT, row->rsize - i);
+	if(t->tries) {
+	    if((t->tries & LEX_TRY_SCS) && i + L->scs_len <= n &&
+		    !memcmp(&render[i], L->scs, L->scs_len)) {
+		memset(&hl[i], HL_COMMENT, n - i);
 		break;
 	    }
-	}
-
-	if(mcs_len && mce_len && !in_string) {
-	    if(in_comment) {
-		row->hl[i] = HL_MLCOMMENT;
-		if(!strncmp(&row->render[i], mce, mce_len)) {
-		    memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-		    i += mce_len;
-		    in_comment = 0;
-		    prev_sep = 1;
-		    continue;
-		} else {
-		    i++;
-		    continue;
-		} 
-	    } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-		    memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-		    i += mcs_len;
-		    in_comment = 1;
-		    continue;
+	    if((t->tries & LEX_TRY_MCS) && i + L->mcs_len <= n &&
+		    !memcmp(&render[i], L->mcs, L->mcs_len)) {
+		memset(&hl[i], HL_MLCOMMENT, L->mcs_len);
+		i += L->mcs_len;
+		state = LEX_MLCOMMENT;
+		continue;
 	    }
-	}
-
-	if(E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-	    if(in_string) {
-		row->hl[i] = HL_STRING;
-		if (c == '\\' && i + 1 < row->rsize) {
-		    row->hl[i +1] = HL_STRING;
-		    i += 2;
-		    continue;
-		}
-		if(c == in_string) in_string = 0;
-		i++;
-		prev_sep = 1;
+	    if((t->tries & LEX_TRY_MCE) && i + L->mce_len <= n &&
+		    !memcmp(&render[i], L->mce, L->mce_len)) {
+		memset(&hl[i], HL_MLCOMMENT, L->mce_len);
+		i += L->mce_len;
+		state = LEX_SEP;
 		continue;
-	    } else {
-		if(c == '"' || c == '\'') {
-		    in_string = c;
-		    row->hl[i] = HL_STRING;
-		    i++;
-		    continue;
-		}
 	    }
-	}
-	
-	if(E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-	    if((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
-		(c == '.' && prev_hl == HL_NUMBER)) {
-		row->hl[i] = HL_NUMBER;
-		i++;
-		prev_sep = 0;
+	    if((t->tries & LEX_TRY_ESCAPE) && i + 1 < n) {
+		hl[i] = HL_STRING;
+		hl[i + 1] = HL_STRING;
+		i += 2;
 		continue;
 	    }
-	}
-
-	if(prev_sep) {
-	    int j;
-	    for(j = 0; keywords[j]; j++) {
-		int klen = strlen(keywords[j]);
-		int kw2 = keywords[j][klen - 1] == '|';
-		if(kw2) klen--;
-
-		if(!strncmp(&row->render[i], keywords[j], klen) &&
-			is_separator(row->render[i + klen])) {
-		    memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-		    i += klen;
-		    break;
+	    if(t->tries & LEX_TRY_KEYWORD) {
+		struct lexKeyword *kw = lexMatchKeyword(L, render, i, n);
+		if(kw) {
+		    memset(&hl[i], kw->hl, kw->len);
+		    i += kw->len;
+		    state = LEX_WORD;
+		    continue;
 		}
 	    }
-	    if(keywords[j] != NULL) {
-		prev_sep = 0;
-		continue;
-	    }
 	}
-	prev_sep = is_separator(c);
-	i++;
+
+	hl[i++] = t->hl;
+	state = t->next;
+    }
+    return state == LEX_MLCOMMENT;
+}
+
+// Highlights a single row. Returns whether the multi-line comment state at
+// its end changed, in which case the next row has to be highlighted again
+int editorHighlightRow(erow *row) {
+    row->hl = realloc(row->hl, row->rsize);
+
+    if(E.syntax == NULL) {
+	memset(row->hl, HL_NORMAL, row->rsize);
+	editorRowBrackets(row);
+	return 0;
     }
 
+    int in_comment = editorLexRow(row, row->hl);
     int changed = (row->hl_open_comment != in_comment);
     row->hl_open_comment = in_comment;
-    if(changed && row->idx + 1 < E.numrows)
-	editorUpdateSyntax(&E.row[row->idx + 1]);
+    editorRowBrackets(row);
+    return changed;
+}
+
+// Rows loaded from the session cache have a comment state but no
+// highlighting until something looks at them
+void editorEnsureSyntax(erow *row) {
+    if(row->hl == NULL) editorHighlightRow(row);
+}
+
+void editorUpdateSyntax(erow *row) {
+    // Loops instead of recursing into the next row when the open comment
+    // state changes so that a "/*" at the top of a huge file can't blow the
+    // stack
+    while (editorHighlightRow(row) && row->idx + 1 < E.numrows)
+	row = &E.row[row->idx + 1];
+}
+
+// Highlights rows first to last once each, then keeps going for as long as
+// the comment state keeps changing
+void editorUpdateSyntaxRange(int first, int last) {
+    int i;
+    for(i = first; i < E.numrows; i++)
+	if(!editorHighlightRow(&E.row[i]) && i >= last) break;
+}
+
+// Same for an ascending list of changed rows, rows in between are only
+// highlighted when a change in comment state reaches them
+void editorUpdateSyntaxRows(int *rows, int n) {
+    int k = 0;
+    int i = n ? rows[0] : E.numrows;
+    while (i < E.numrows) {
+	while (k < n && rows[k] <= i) k++;
+	if(editorHighlightRow(&E.row[i])) i++;
+	else if(k < n) i = rows[k];
+	else break;
+    }
 }
 
 int editorSyntaxToColor(int hl) {
@@ -399,7 +1030,11 @@ int editorSyntaxToColor(int hl) {
 void editorSelectSyntaxHighlight() {
     E.syntax = NULL;
     if(E.filename == NULL) return;
-    char *ext = strrchr(E.filename, '.');
+    // foo.c.gz is highlighted as foo.c
+    struct editorCodec *codec = editorFileCodec(E.filename);
+    char *name = strndup(E.filename,
+	    strlen(E.filename) - (codec ? strlen(codec->ext) : 0));
+    char *ext = strrchr(name, '.');
 
     for(unsigned int j = 0; j < HLDB_ENTRIES; j++) {
 	struct editorSyntax *s = &HLDB[j];
@@ -407,317 +1042,3542 @@ void editorSelectSyntaxHighlight() {
 	while(s->filematch[i]) {
 	    int is_ext = s->filematch[i][0] == '.';
 	    if((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
-		(!is_ext && strstr(E.filename, s->filematch[i]))) {
+		(!is_ext && strstr(name, s->filematch[i]))) {
 		E.syntax = s;
+		if(s->lexer == NULL) s->lexer = editorCompileSyntax(s);
 
 		int filerow;
 		for(filerow = 0; filerow < E.numrows; filerow++) {
 		    editorUpdateSyntax(&E.row[filerow]);
 		}
+		free(name);
 		return;
 	    }
 	    i++;
 	}
     }
+    free(name);
 }
 
-/*** row operations ***/
-int editorRowCxToRx(erow *row, int cx) {
-    int rx = 0;
-    int j;
-    for(j = 0; j < cx; j++) {
-	if(row->chars[j] == '\t')
-	    rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
-	rx++;
-    }
-    return rx;
+/*** syntax definitions ***/
+// Syntax definitions are read at startup from $KILO_SYNTAX_DIR, or
+// ~/.kilo/syntax when it's not set. Every *.syntax file holds one
+// definition, one directive per line and words separated by blanks:
+//
+//   filetype python
+//   filematch .py .pyw
+//   keywords if elif else while for def return
+//   types int str float
+//   comment #
+//   multiline_comment """ """
+//   highlight numbers strings
+//
+// Definitions are only compiled into lexer tables the first time a file
+// picks them, and the compiled table is kept for the next file.
+
+char **syntaxListAppend(char **list, int *len, char *s) {
+    list = realloc(list, sizeof(char *) * (*len + 2));
+    list[(*len)++] = s;
+    list[*len] = NULL;
+    return list;
 }
 
-int editorRowRxToCx(erow * row, int rx) {
-    int cur_rx = 0;
-    int cx;
-    for(cx = 0; cx < row->size; cx++) {
-	if(row->chars[cx] == '\t') {
-	    cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
+void syntaxListFree(char **list) {
+    if(list == NULL) return;
+    char **p;
+    for(p = list; *p; p++) free(*p);
+    free(list);
+}
+
+// Frees what a definition that didn't load got as far as
+void editorFreeSyntaxFile(struct editorSyntax *s) {
+    free(s->filetype);
+    syntaxListFree(s->filematch);
+    syntaxListFree(s->keywords);
+    free(s->singleline_comment_start);
+    free(s->multiline_comment_start);
+    free(s->multiline_comment_end);
+    memset(s, 0, sizeof(struct editorSyntax));
+}
+
+int editorLoadSyntaxFile(const char *path, struct editorSyntax *s) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) return -1;
+
+    memset(s, 0, sizeof(struct editorSyntax));
+    int nmatch = 0, nkeywords = 0;
+
+    char *line = NULL;
+    size_t linecap = 0;
+    while (getline(&line, &linecap, fp) != -1) {
+	char *save;
+	char *key = strtok_r(line, " \t\r\n", &save);
+	if(key == NULL || key[0] == '#') continue;
+
+	char *word;
+	if(!strcmp(key, "filetype")) {
+	    if((word = strtok_r(NULL, " \t\r\n", &save))) {
+		free(s->filetype);
+		s->filetype = strdup(word);
+	    }
+	} else if(!strcmp(key, "filematch")) {
+	    while ((word = strtok_r(NULL, " \t\r\n", &save)))
+		s->filematch = syntaxListAppend(s->filematch, &nmatch,
+			strdup(word));
+	} else if(!strcmp(key, "keywords") || !strcmp(key, "types")) {
+	    int kw2 = !strcmp(key, "types");
+	    while ((word = strtok_r(NULL, " \t\r\n", &save))) {
+		// Secondary keywords are marked with a trailing | like in
+		// C_HL_keywords
+		char *k = malloc(strlen(word) + 2);
+		sprintf(k, kw2 ? "%s|" : "%s", word);
+		s->keywords = syntaxListAppend(s->keywords, &nkeywords, k);
+	    }
+	} else if(!strcmp(key, "comment")) {
+	    if((word = strtok_r(NULL, " \t\r\n", &save))) {
+		free(s->singleline_comment_start);
+		s->singleline_comment_start = strdup(word);
+	    }
+	} else if(!strcmp(key, "multiline_comment")) {
+	    char *end;
+	    if((word = strtok_r(NULL, " \t\r\n", &save)) &&
+		    (end = strtok_r(NULL, " \t\r\n", &save))) {
+		free(s->multiline_comment_start);
+		free(s->multiline_comment_end);
+		s->multiline_comment_start = strdup(word);
+		s->multiline_comment_end = strdup(end);
+	    }
+	} else if(!strcmp(key, "highlight")) {
+	    while ((word = strtok_r(NULL, " \t\r\n", &save))) {
+		if(!strcmp(word, "numbers")) s->flags |= HL_HIGHLIGHT_NUMBERS;
+		else if(!strcmp(word, "strings")) s->flags |= HL_HIGHLIGHT_STRINGS;
+	    }
 	}
-	cur_rx++;
+    }
+    free(line);
+    fclose(fp);
 
-	if(cur_rx > rx) return cx;
+    // A definition that can never be picked is of no use
+    if(s->filetype == NULL || s->filematch == NULL) {
+	editorFreeSyntaxFile(s);
+	return -1;
     }
-    return cx;
+    if(s->keywords == NULL)
+	s->keywords = calloc(1, sizeof(char *));
+    return 0;
 }
 
-void editorUpdateRow(erow *row) {
-    int tabs = 0;
-    int j;
-    for(j = 0; j < row->size; j++)
-	if(row->chars[j] == '\t') tabs++;
+void editorLoadSyntaxDefinitions() {
+    char path[4096];
+    const char *dir = getenv("KILO_SYNTAX_DIR");
+    if(dir == NULL) {
+	const char *home = getenv("HOME");
+	if(home == NULL) return;
+	snprintf(path, sizeof(path), "%s/.kilo/syntax", home);
+	dir = path;
+    }
+    char *dirpath = strdup(dir);
 
-    free(row -> render);
-    row->render = malloc(row->size + tabs*(KILO_TAB_STOP - 1) + 1);
+    DIR *d = opendir(dirpath);
+    if(d == NULL) {
+	free(dirpath);
+	return;
+    }
 
-    int idx = 0;
-    for(j = 0; j < row->size; j++) {
-	if(row->chars[j] == '\t') {
-	    row->render[idx++] = ' ';
-	    while(idx % KILO_TAB_STOP != 0) row->render[idx++] = ' ';
-	} else {
-	    row->render[idx++] = row->chars[j];
-	}
+    struct editorSyntax *db = NULL;
+    unsigned int n = 0;
+    struct dirent *ent;
+    while ((ent = readdir(d))) {
+	int len = strlen(ent->d_name);
+	if(len <= 7 || strcmp(&ent->d_name[len - 7], ".syntax")) continue;
+	snprintf(path, sizeof(path), "%s/%s", dirpath, ent->d_name);
+
+	db = realloc(db, sizeof(struct editorSyntax) *
+		(n + 1 + HLDB_BUILTIN_ENTRIES));
+	if(editorLoadSyntaxFile(path, &db[n]) == 0) n++;
     }
-    row->render[idx] = '\0';
-    row->rsize = idx;
-    editorUpdateSyntax(row);
+    closedir(d);
+    free(dirpath);
+    if(n == 0) {
+	free(db);
+	return;
+    }
+
+    memcpy(&db[n], HLDB_BUILTIN, sizeof(HLDB_BUILTIN));
+    HLDB = db;
+    HLDB_ENTRIES = n + HLDB_BUILTIN_ENTRIES;
 }
 
-void editorInsertRow(int at, char *s, size_t len) {
-    if(at < 0 || at > E.numrows) return;
-    E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-    memmove(&E.row[at +1], &E.row[at], sizeof(erow) * (E.numrows - at));
-    for (int j = at + 1; j <= E.numrows; j++) E.row[j].idx++;
+/*** row index ***/
+// A row going in or out only moves the measures after it in its own block
+// and updates the trees over the blocks. A full block is split in two and
+// an empty one dropped, which builds the trees again in O(n / block)
 
-    E.row[at].idx = at;
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    E.row[at].hl = NULL;
-    E.row[at].hl_open_comment = 0;
-    editorUpdateRow(&E.row[at]);
-    E.numrows++;
-    E.dirty++;
+int rowIndexLowbit(int i) {
+    return i & -i;
 }
 
-void editorFreeRow(erow *row) {
-    free(row->render);
-    free(row->chars);
-    free(row->hl);
+// Builds the trees over the blocks from their sums and counts
+void rowIndexLink(struct rowIndex *ix) {
+    int i;
+    for(i = 1; i <= ix->nblocks; i++) {
+	ix->sums[i] = ix->blocks[i - 1].sum;
+	ix->counts[i] = ix->blocks[i - 1].n;
+    }
+    for(i = 1; i <= ix->nblocks; i++) {
+	int parent = i + rowIndexLowbit(i);
+	if(parent > ix->nblocks) continue;
+	ix->sums[parent] += ix->sums[i];
+	ix->counts[parent] += ix->counts[i];
+    }
 }
 
-void editorDelRow(int at) {
-    if( at < 0 || at >= E.numrows) return;
-    editorFreeRow(&E.row[at]);
-    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-    for(int j = at; j < E.numrows - 1; j++) E.row[j].idx--;
-    E.numrows--;
-    E.dirty++;
+// Puts an empty block at k, the trees are left for rowIndexLink
+void rowIndexAddBlock(struct rowIndex *ix, int k) {
+    if(ix->nblocks == ix->capblocks) {
+	ix->capblocks = ix->capblocks ? ix->capblocks * 2 : 16;
+	ix->blocks = realloc(ix->blocks, sizeof(struct rowBlock) * ix->capblocks);
+	ix->sums = realloc(ix->sums, sizeof(long long) * (ix->capblocks + 1));
+	ix->counts = realloc(ix->counts, sizeof(int) * (ix->capblocks + 1));
+    }
+    memmove(&ix->blocks[k + 1], &ix->blocks[k],
+	    sizeof(struct rowBlock) * (ix->nblocks - k));
+    ix->blocks[k].val = malloc(sizeof(int) * KILO_INDEX_BLOCK);
+    ix->blocks[k].n = 0;
+    ix->blocks[k].sum = 0;
+    ix->nblocks++;
 }
 
-void editorRowInsertChar(erow *row, int at, int c) {
-    if (at < 0 || at > row->size) at = row->size;
-    row->chars = realloc(row->chars, row->size + 2);
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-    row->size++;
-    row->chars[at] = c;
-    editorUpdateRow(row);
-    E.dirty++;
+void rowIndexDropBlock(struct rowIndex *ix, int k) {
+    free(ix->blocks[k].val);
+    memmove(&ix->blocks[k], &ix->blocks[k + 1],
+	    sizeof(struct rowBlock) * (ix->nblocks - k - 1));
+    ix->nblocks--;
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len) {
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len);
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
-    E.dirty++;
+void rowIndexFree(struct rowIndex *ix) {
+    while (ix->nblocks) rowIndexDropBlock(ix, ix->nblocks - 1);
+    free(ix->blocks);
+    free(ix->sums);
+    free(ix->counts);
 }
 
-void editorRowDelChar(erow *row, int at) {
-    if(at < 0 || at >= row->size) return;
-    memmove(&row->chars[at], &row->chars[at+1], row->size - at);
-    row->size--;
-    editorUpdateRow(row);
-    E.dirty++;
+// Blocks start half full so rows can go in before one has to split
+void rowIndexBuild(struct rowIndex *ix) {
+    int half = KILO_INDEX_BLOCK / 2, i, j;
+    int nblocks = (E.numrows + half - 1) / half;
+    while (ix->nblocks < nblocks) rowIndexAddBlock(ix, ix->nblocks);
+    while (ix->nblocks > nblocks) rowIndexDropBlock(ix, ix->nblocks - 1);
+    for(i = 0; i < nblocks; i++) {
+	struct rowBlock *b = &ix->blocks[i];
+	b->n = E.numrows - i * half < half ? E.numrows - i * half : half;
+	b->sum = 0;
+	for(j = 0; j < b->n; j++) {
+	    b->val[j] = ix->measure(ix, &E.row[i * half + j]);
+	    b->sum += b->val[j];
+	}
+    }
+    ix->n = E.numrows;
+    rowIndexLink(ix);
+    ix->stale = 0;
 }
 
-/*** editor operations ***/
+void rowIndexInvalidate(struct rowIndex *ix) {
+    ix->stale = 1;
+}
 
-void editorInsertChar(int c) {
+// Block holding row at and where in it the row is. Row n is the one past
+// the end of the last block
+int rowIndexBlock(struct rowIndex *ix, int at, int *off) {
+    int k = 0;
+    int step = 1;
+    while (step * 2 <= ix->nblocks) step *= 2;
+    for(; step > 0; step /= 2) {
+	if(k + step <= ix->nblocks && ix->counts[k + step] <= at) {
+	    k += step;
+	    at -= ix->counts[k];
+	}
+    }
+    if(k == ix->nblocks && k > 0) {
+	k--;
+	at += ix->blocks[k].n;
+    }
+    *off = at;
+    return k;
+}
+
+// Adds to the sum and rows of block k in the trees
+void rowIndexAdd(struct rowIndex *ix, int k, long long delta, int rows) {
+    for(k++; k <= ix->nblocks; k += rowIndexLowbit(k)) {
+	ix->sums[k] += delta;
+	ix->counts[k] += rows;
+    }
+}
+
+// Sum of the measure of rows [0, at)
+long long rowIndexSum(struct rowIndex *ix, int at) {
+    if(ix->stale) rowIndexBuild(ix);
+    if(at > ix->n) at = ix->n;
+    int off, k = rowIndexBlock(ix, at, &off), i, j;
+    long long sum = 0;
+    for(i = k; i > 0; i -= rowIndexLowbit(i)) sum += ix->sums[i];
+    if(off == 0) return sum;
+    // Whichever end of the block is nearer
+    struct rowBlock *b = &ix->blocks[k];
+    if(off * 2 <= b->n) {
+	for(j = 0; j < off; j++) sum += b->val[j];
+    } else {
+	sum += b->sum;
+	for(j = off; j < b->n; j++) sum -= b->val[j];
+    }
+    return sum;
+}
+
+long long rowIndexTotal(struct rowIndex *ix) {
+    return rowIndexSum(ix, E.numrows);
+}
+
+// The row holding position pos and how far into it pos is. Positions past
+// the end give E.numrows
+int rowIndexFind(struct rowIndex *ix, long long pos, long long *rem) {
+    if(ix->stale) rowIndexBuild(ix);
+    int k = 0, at = 0;
+    int step = 1;
+    while (step * 2 <= ix->nblocks) step *= 2;
+    for(; step > 0; step /= 2) {
+	if(k + step <= ix->nblocks && ix->sums[k + step] <= pos) {
+	    k += step;
+	    pos -= ix->sums[k];
+	    at += ix->counts[k];
+	}
+    }
+    if(k < ix->nblocks) {
+	struct rowBlock *b = &ix->blocks[k];
+	int j;
+	for(j = 0; j < b->n && b->val[j] <= pos; j++) pos -= b->val[j];
+	at += j;
+    }
+    if(rem) *rem = pos;
+    return at;
+}
+
+void rowIndexUpdate(struct rowIndex *ix, int at) {
+    if(ix->stale || at >= ix->n) return;
+    int off, k = rowIndexBlock(ix, at, &off);
+    struct rowBlock *b = &ix->blocks[k];
+    int v = ix->measure(ix, &E.row[at]);
+    int delta = v - b->val[off];
+    if(delta == 0) return;
+    b->val[off] = v;
+    b->sum += delta;
+    rowIndexAdd(ix, k, delta, 0);
+}
+
+// Called once the row is in E.row
+void rowIndexInsert(struct rowIndex *ix, int at) {
+    if(ix->stale) return;
+    if(ix->nblocks == 0) {
+	rowIndexAddBlock(ix, 0);
+	rowIndexLink(ix);
+    }
+    int off, k = rowIndexBlock(ix, at, &off), j;
+    struct rowBlock *b = &ix->blocks[k];
+    if(b->n == KILO_INDEX_BLOCK) {
+	// The second half goes to a new block after it
+	int half = KILO_INDEX_BLOCK / 2;
+	rowIndexAddBlock(ix, k + 1);
+	b = &ix->blocks[k];
+	struct rowBlock *next = &ix->blocks[k + 1];
+	memcpy(next->val, &b->val[half], sizeof(int) * (b->n - half));
+	next->n = b->n - half;
+	for(j = 0; j < next->n; j++) next->sum += next->val[j];
+	b->n = half;
+	b->sum -= next->sum;
+	rowIndexLink(ix);
+	if(off > half) {
+	    k++;
+	    off -= half;
+	    b = next;
+	}
+    }
+    int v = ix->measure(ix, &E.row[at]);
+    memmove(&b->val[off + 1], &b->val[off], sizeof(int) * (b->n - off));
+    b->val[off] = v;
+    b->n++;
+    b->sum += v;
+    ix->n++;
+    rowIndexAdd(ix, k, v, 1);
+}
+
+void rowIndexDelete(struct rowIndex *ix, int at) {
+    if(ix->stale || at >= ix->n) return;
+    int off, k = rowIndexBlock(ix, at, &off);
+    struct rowBlock *b = &ix->blocks[k];
+    int v = b->val[off];
+    memmove(&b->val[off], &b->val[off + 1], sizeof(int) * (b->n - off - 1));
+    b->n--;
+    b->sum -= v;
+    ix->n--;
+    if(b->n == 0) {
+	rowIndexDropBlock(ix, k);
+	rowIndexLink(ix);
+    } else {
+	rowIndexAdd(ix, k, -v, -1);
+    }
+}
+
+// Rows [at, at + deln) were replaced by the insn rows now in E.row from at
+void rowIndexSplice(struct rowIndex *ix, int at, int deln, int insn) {
+    if(ix->stale) return;
+    // A rebuild is cheaper for large changes
+    if(deln + insn >= 1024 && deln + insn > ix->n / 16) {
+	ix->stale = 1;
+	return;
+    }
+    int j;
+    for(j = 0; j < deln; j++) rowIndexDelete(ix, at);
+    for(j = 0; j < insn; j++) rowIndexInsert(ix, at + j);
+}
+
+int editorRowBytes(struct rowIndex *ix, erow *row) {
+    (void) ix;
+    return row->size + 1;
+}
+
+/*** soft wrap ***/
+
+int editorRowLines(erow *row, int cols) {
+    if(row->rsize <= cols) return 1;
+    return (row->rsize + cols - 1) / cols;
+}
+
+int editorRowVisualLines(erow *row) {
+    return editorRowLines(row, E.screencols);
+}
+
+int editorWrapMeasure(struct rowIndex *ix, erow *row) {
+    return editorRowLines(row, ix->cols);
+}
+
+// Whether the current view or a client of the server is cols wide
+int editorWidthUsed(int cols) {
+    int k;
+    if(cols == E.screencols) return 1;
+    for(k = 0; k < E.nclients; k++)
+	if(k != E.current && E.clients[k].view.screencols == cols) return 1;
+    return 0;
+}
+
+// The wrap index for the current width. Clients of a server can have
+// terminals of different widths, each of which keeps its own index that
+// every edit goes to, so switching between clients doesn't rebuild one.
+// Indexes for widths nobody has any more go when a new one is made
+struct rowIndex *editorWrapIndex() {
+    int k;
+    for(k = 0; k < E.nwraps; k++)
+	if(E.wraps[k]->cols == E.screencols) return E.wraps[k];
+    for(k = E.nwraps - 1; k >= 0; k--) {
+	struct rowIndex *ix = E.wraps[k];
+	if(editorWidthUsed(ix->cols)) continue;
+	rowIndexFree(ix);
+	free(ix);
+	E.wraps[k] = E.wraps[--E.nwraps];
+    }
+    struct rowIndex *ix = calloc(1, sizeof(struct rowIndex));
+    ix->measure = editorWrapMeasure;
+    ix->cols = E.screencols;
+    ix->stale = 1;
+    E.wraps = realloc(E.wraps, sizeof(struct rowIndex *) * (E.nwraps + 1));
+    E.wraps[E.nwraps++] = ix;
+    return ix;
+}
+
+void editorWrapUpdate(int at) {
+    int k;
+    for(k = 0; k < E.nwraps; k++) rowIndexUpdate(E.wraps[k], at);
+}
+
+void editorWrapInsert(int at) {
+    int k;
+    for(k = 0; k < E.nwraps; k++) rowIndexInsert(E.wraps[k], at);
+}
+
+void editorWrapDelete(int at) {
+    int k;
+    for(k = 0; k < E.nwraps; k++) rowIndexDelete(E.wraps[k], at);
+}
+
+void editorWrapSplice(int at, int deln, int insn) {
+    int k;
+    for(k = 0; k < E.nwraps; k++) rowIndexSplice(E.wraps[k], at, deln, insn);
+}
+
+void editorWrapInvalidate() {
+    int k;
+    for(k = 0; k < E.nwraps; k++) rowIndexInvalidate(E.wraps[k]);
+}
+
+// Visual line of a render position, a cursor right after the last
+// character of a full line stays on that line
+int editorWrapLine(erow *row, int rx) {
+    int line = rx / E.screencols;
+    int last = editorRowVisualLines(row) - 1;
+    return line > last ? last : line;
+}
+
+int editorCursorVisualLine() {
+    long long v = rowIndexSum(editorWrapIndex(), E.cy);
+    if(E.cy < E.numrows) v += editorWrapLine(&E.row[E.cy], E.rx);
+    return v;
+}
+
+void editorToggleWrap() {
+    if(E.wrap) {
+	// Keep the same row at the top of the screen
+	E.rowoff = rowIndexFind(editorWrapIndex(), E.rowoff, NULL);
+	// Nothing needs the index until wrap is back on
+	rowIndexInvalidate(editorWrapIndex());
+	E.wrap = 0;
+    } else {
+	E.wrap = 1;
+	E.rowoff = rowIndexSum(editorWrapIndex(), E.rowoff);
+    }
+    editorSetStatusMessage("Soft wrap %s", E.wrap ? "on" : "off");
+}
+
+/*** brackets ***/
+
+// Type plus one for opens, negated for closes
+const signed char bracketTable[256] = {
+    ['('] = 1, [')'] = -1, ['['] = 2, [']'] = -2, ['{'] = 3, ['}'] = -3,
+};
+
+// Which of the bracket types c is, or -1. dir is 1 for opens, -1 for closes
+int bracketType(int c, int *dir) {
+    int v = bracketTable[(unsigned char) c];
+    *dir = v > 0 ? 1 : -1;
+    return (v > 0 ? v : -v) - 1;
+}
+
+// Brackets in strings and comments don't count
+int bracketIsCode(erow *row, int rx) {
+    editorEnsureSyntax(row);
+    int hl = row->hl[rx];
+    return hl != HL_STRING && hl != HL_COMMENT && hl != HL_MLCOMMENT;
+}
+
+// Counts a row's brackets from its highlighting. Rows the session cache left
+// unhighlighted are lexed into scratch space instead, otherwise the first
+// match in a reopened file would keep highlighting for every row of it
+void bracketCount(erow *row) {
+    static unsigned char *scratch = NULL;
+    static int scratchsize = 0;
+    unsigned char *hl = row->hl;
+    if(hl == NULL && E.syntax) {
+	if(scratchsize < row->rsize) {
+	    scratchsize = row->rsize;
+	    scratch = realloc(scratch, scratchsize);
+	}
+	editorLexRow(row, scratch);
+	hl = scratch;
+    }
+    struct bracketSum b;
+    memset(&b, 0, sizeof(struct bracketSum));
+    unsigned char *render = (unsigned char *) row->render;
+    int n = row->rsize, i;
+    for(i = 0; i < n; i++) {
+	int v = bracketTable[render[i]];
+	if(!v || (hl && (hl[i] == HL_STRING || hl[i] == HL_COMMENT ||
+		hl[i] == HL_MLCOMMENT)))
+	    continue;
+	int t = (v > 0 ? v : -v) - 1;
+	b.net[t] += v > 0 ? 1 : -1;
+	if(b.net[t] < b.min[t]) b.min[t] = b.net[t];
+    }
+    row->brackets = b;
+    row->brackets_stale = 0;
+}
+
+void bracketCombine(struct bracketSum *out, struct bracketSum *a,
+	struct bracketSum *b) {
+    int t;
+    for(t = 0; t < KILO_BRACKET_TYPES; t++) {
+	int m = a->net[t] + b->min[t];
+	out->min[t] = a->min[t] < m ? a->min[t] : m;
+	out->net[t] = a->net[t] + b->net[t];
+    }
+}
+
+void bracketIndexBuild(struct bracketIndex *ix) {
+    int size = 1, i;
+    while (size < E.numrows) size *= 2;
+    if(size != ix->size) {
+	ix->tree = realloc(ix->tree, sizeof(struct bracketSum) * 2 * size);
+	ix->size = size;
+    }
+    ix->n = E.numrows;
+    memset(&ix->tree[size], 0, sizeof(struct bracketSum) * size);
+    for(i = 0; i < ix->n; i++) {
+	if(E.row[i].brackets_stale) bracketCount(&E.row[i]);
+	ix->tree[size + i] = E.row[i].brackets;
+    }
+    for(i = size - 1; i >= 1; i--)
+	bracketCombine(&ix->tree[i], &ix->tree[2 * i], &ix->tree[2 * i + 1]);
+    ix->gap = ix->n;
+    ix->ndirty = 0;
+    ix->stale = 0;
+}
+
+// Leaf of row at, counted from the first leaf. Rows from gap on come after
+// the free leaves
+int bracketLeaf(struct bracketIndex *ix, int at) {
+    return at < ix->gap ? at : at + ix->size - ix->n;
+}
+
+int bracketLeafRow(struct bracketIndex *ix, int leaf) {
+    return leaf < ix->gap ? leaf : leaf - (ix->size - ix->n);
+}
+
+// Combines the nodes above leaves [lo, hi) again, a level at a time
+void bracketIndexFix(struct bracketIndex *ix, int lo, int hi) {
+    if(lo >= hi) return;
+    lo += ix->size;
+    hi += ix->size - 1;
+    while (lo > 1) {
+	lo /= 2;
+	hi /= 2;
+	int i;
+	for(i = lo; i <= hi; i++)
+	    bracketCombine(&ix->tree[i], &ix->tree[2 * i], &ix->tree[2 * i + 1]);
+    }
+}
+
+void bracketIndexSet(struct bracketIndex *ix, int at, struct bracketSum *b) {
+    int i = ix->size + bracketLeaf(ix, at);
+    ix->tree[i] = *b;
+    for(i /= 2; i >= 1; i /= 2)
+	bracketCombine(&ix->tree[i], &ix->tree[2 * i], &ix->tree[2 * i + 1]);
+}
+
+// Moves the free leaves to just before row at. Only the leaves of the rows
+// between the old place and the new one move, along with the free ones
+// they trade places with
+void bracketIndexMoveGap(struct bracketIndex *ix, int at) {
+    int g = ix->size - ix->n;
+    struct bracketSum *leaf = &ix->tree[ix->size];
+    size_t sz = sizeof(struct bracketSum);
+    if(g == 0 || at == ix->gap) {
+	ix->gap = at;
+	return;
+    }
+    // Leaves the moved rows left that the gap doesn't cover anyway
+    int d = at < ix->gap ? ix->gap - at : at - ix->gap;
+    int freed = d < g ? d : g;
+    if(at < ix->gap) {
+	memmove(&leaf[at + g], &leaf[at], sz * d);
+	memset(&leaf[at], 0, sz * freed);
+	bracketIndexFix(ix, at, at + freed);
+	bracketIndexFix(ix, at + g, ix->gap + g);
+    } else {
+	memmove(&leaf[ix->gap], &leaf[ix->gap + g], sz * d);
+	memset(&leaf[at + g - freed], 0, sz * freed);
+	bracketIndexFix(ix, ix->gap, at);
+	bracketIndexFix(ix, at + g - freed, at + g);
+    }
+    ix->gap = at;
+}
+
+// Row at was highlighted since it was counted
+void bracketIndexDirty(struct bracketIndex *ix, int at) {
+    // Past a point one rebuild is cheaper than updating leaf by leaf
+    if(ix->ndirty >= 1024 && ix->ndirty > ix->n / 16) {
+	ix->stale = 1;
+	return;
+    }
+    if(ix->ndirty == ix->capdirty) {
+	ix->capdirty = ix->capdirty ? ix->capdirty * 2 : 64;
+	ix->dirty = realloc(ix->dirty, sizeof(int) * ix->capdirty);
+    }
+    ix->dirty[ix->ndirty++] = at;
+}
+
+// Brings the tree up to date before a query, counting only the rows that
+// were highlighted since the last one
+void bracketIndexFlush(struct bracketIndex *ix) {
+    if(ix->stale) {
+	bracketIndexBuild(ix);
+	return;
+    }
+    int k;
+    for(k = 0; k < ix->ndirty; k++) {
+	int at = ix->dirty[k];
+	if(at >= ix->n || !E.row[at].brackets_stale) continue;
+	bracketCount(&E.row[at]);
+	bracketIndexSet(ix, at, &E.row[at].brackets);
+    }
+    ix->ndirty = 0;
+}
+
+// Rows [at, at + deln) were replaced by the insn rows now in E.row from
+// at. The gap moves there, takes the deleted leaves and gives the inserted
+// ones, so an edit costs the distance from the last one plus O(log n)
+void bracketIndexSplice(struct bracketIndex *ix, int at, int deln, int insn) {
+    if(ix->stale) return;
+    int n = ix->n - deln + insn, j, k = 0;
+    // A rebuild is cheaper for large changes, and resizes the tree when
+    // it's full or mostly empty
+    if((deln + insn >= 1024 && deln + insn > ix->n / 16) || n > ix->size ||
+	    (ix->size > 64 && n < ix->size / 4)) {
+	ix->stale = 1;
+	return;
+    }
+    bracketIndexMoveGap(ix, at + deln);
+    struct bracketSum *leaf = &ix->tree[ix->size];
+    memset(&leaf[at], 0, sizeof(struct bracketSum) * deln);
+    for(j = 0; j < ix->ndirty; j++) {
+	int r = ix->dirty[j];
+	if(r < at) ix->dirty[k++] = r;
+	else if(r >= at + deln) ix->dirty[k++] = r + insn - deln;
+    }
+    ix->ndirty = k;
+    ix->n = n;
+    ix->gap = at + insn;
+    for(j = 0; j < insn; j++) {
+	erow *row = &E.row[at + j];
+	leaf[at + j] = row->brackets;
+	if(row->brackets_stale) bracketIndexDirty(ix, at + j);
+    }
+    bracketIndexFix(ix, at, at + (deln > insn ? deln : insn));
+}
+
+// First row from row from on where d unmatched opens of type t get closed.
+// Rows skipped on the way are taken off d. Returns -1 when there is none
+int bracketIndexForward(struct bracketIndex *ix, int node, int lo, int hi,
+	int from, int t, int *d) {
+    if(hi <= from) return -1;
+    struct bracketSum *b = &ix->tree[node];
+    if(lo >= from && *d + b->min[t] > 0) {
+	*d += b->net[t];
+	return -1;
+    }
+    if(hi - lo == 1) return lo;
+    int mid = (lo + hi) / 2;
+    int r = bracketIndexForward(ix, 2 * node, lo, mid, from, t, d);
+    if(r == -1) r = bracketIndexForward(ix, 2 * node + 1, mid, hi, from, t, d);
+    return r;
+}
+
+// Same going back from row to, for d unmatched closes. The most a run
+// can open reading right to left is net - min
+int bracketIndexBackward(struct bracketIndex *ix, int node, int lo, int hi,
+	int to, int t, int *d) {
+    if(lo > to) return -1;
+    struct bracketSum *b = &ix->tree[node];
+    if(hi - 1 <= to && b->net[t] - b->min[t] < *d) {
+	*d -= b->net[t];
+	return -1;
+    }
+    if(hi - lo == 1) return lo;
+    int mid = (lo + hi) / 2;
+    int r = bracketIndexBackward(ix, 2 * node + 1, mid, hi, to, t, d);
+    if(r == -1) r = bracketIndexBackward(ix, 2 * node, lo, mid, to, t, d);
+    return r;
+}
+
+// Called whenever a row is highlighted, since that changes which of its
+// brackets are code. The row is only counted again at the next query, so
+// highlighting, which runs far more often than queries, doesn't pay for it
+void editorRowBrackets(erow *row) {
+    struct bracketIndex *ix = &E.brackets;
+    if(row->brackets_stale) return;
+    row->brackets_stale = 1;
+    if(ix->stale || row->idx >= ix->n) return;
+    bracketIndexDirty(ix, row->idx);
+}
+
+// Walks a row from column i to end (exclusive) in steps of step until d
+// unmatched brackets of type t are matched. Returns the column or -1
+int bracketScan(erow *row, int i, int end, int step, int t, int *d) {
+    for(; i != end; i += step) {
+	int dir;
+	if(bracketType(row->render[i], &dir) != t || !bracketIsCode(row, i))
+	    continue;
+	*d += dir * step;
+	if(*d == 0) return i;
+    }
+    return -1;
+}
+
+// Finds the bracket matching the one at render column rx of row at. Only
+// the two rows at either end are scanned, the rows between are skipped
+// through the index
+int editorFindBracketMatch(int at, int rx, int *mrow, int *mrx) {
+    if(at >= E.numrows || rx >= E.row[at].rsize) return 0;
+    erow *row = &E.row[at];
+    int dir, t = bracketType(row->render[rx], &dir);
+    if(t < 0 || !bracketIsCode(row, rx)) return 0;
+    bracketIndexFlush(&E.brackets);
+
+    int d = 1, col;
+    if(dir > 0) {
+	col = bracketScan(row, rx + 1, row->rsize, 1, t, &d);
+	if(col == -1) {
+	    at = bracketIndexForward(&E.brackets, 1, 0, E.brackets.size,
+		    bracketLeaf(&E.brackets, at + 1), t, &d);
+	    if(at == -1) return 0;
+	    at = bracketLeafRow(&E.brackets, at);
+	    col = bracketScan(&E.row[at], 0, E.row[at].rsize, 1, t, &d);
+	}
+    } else {
+	col = bracketScan(row, rx - 1, -1, -1, t, &d);
+	if(col == -1) {
+	    at = bracketIndexBackward(&E.brackets, 1, 0, E.brackets.size,
+		    bracketLeaf(&E.brackets, at - 1), t, &d);
+	    if(at == -1) return 0;
+	    at = bracketLeafRow(&E.brackets, at);
+	    col = bracketScan(&E.row[at], E.row[at].rsize - 1, -1, -1, t, &d);
+	}
+    }
+    *mrow = at;
+    *mrx = col;
+    return 1;
+}
+
+/*** row operations ***/
+int editorRowCxToRx(erow *row, int cx) {
+    int rx = 0;
+    int j;
+    for(j = 0; j < cx; j++) {
+	if(row->chars[j] == '\t')
+	    rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
+	rx++;
+    }
+    return rx;
+}
+
+int editorRowRxToCx(erow * row, int rx) {
+    int cur_rx = 0;
+    int cx;
+    for(cx = 0; cx < row->size; cx++) {
+	if(row->chars[cx] == '\t') {
+	    cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
+	}
+	cur_rx++;
+
+	if(cur_rx > rx) return cx;
+    }
+    return cx;
+}
+
+// Rebuilds render and the row indexes but leaves highlighting to the caller,
+// for changes to many rows that highlight them in one pass
+void editorUpdateRender(erow *row) {
+    int tabs = 0;
+    int j;
+    for(j = 0; j < row->size; j++)
+	if(row->chars[j] == '\t') tabs++;
+
+    free(row -> render);
+    row->render = malloc(row->size + tabs*(KILO_TAB_STOP - 1) + 1);
+
+    int idx = 0;
+    for(j = 0; j < row->size; j++) {
+	if(row->chars[j] == '\t') {
+	    row->render[idx++] = ' ';
+	    while(idx % KILO_TAB_STOP != 0) row->render[idx++] = ' ';
+	} else {
+	    row->render[idx++] = row->chars[j];
+	}
+    }
+    row->render[idx] = '\0';
+    row->rsize = idx;
+    editorWrapUpdate(row->idx);
+    rowIndexUpdate(&E.byteindex, row->idx);
+}
+
+void editorUpdateRow(erow *row) {
+    editorUpdateRender(row);
+    editorUpdateSyntax(row);
+}
+
+void editorInsertRow(int at, char *s, size_t len) {
+    if(at < 0 || at > E.numrows) return;
+    E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
+    memmove(&E.row[at +1], &E.row[at], sizeof(erow) * (E.numrows - at));
+    for (int j = at + 1; j <= E.numrows; j++) E.row[j].idx++;
+
+    E.row[at].idx = at;
+    E.row[at].size = len;
+    E.row[at].chars = malloc(len + 1);
+    memcpy(E.row[at].chars, s, len);
+    E.row[at].chars[len] = '\0';
+    E.row[at].rsize = 0;
+    E.row[at].render = NULL;
+    E.row[at].hl = NULL;
+    // The row that was here got highlighted after the row before this one,
+    // so a new row ending in a different state has to carry on to it
+    E.row[at].hl_open_comment = at > 0 && E.row[at - 1].hl_open_comment;
+    memset(&E.row[at].brackets, 0, sizeof(struct bracketSum));
+    E.row[at].brackets_stale = 0;
+    E.numrows++;
+    editorWrapInsert(at);
+    rowIndexInsert(&E.byteindex, at);
+    bracketIndexSplice(&E.brackets, at, 0, 1);
+    editorUpdateRender(&E.row[at]);
+    editorUpdateSyntax(&E.row[at]);
+    editorMarkChanged(at, 1);
+}
+
+void editorFreeRow(erow *row) {
+    free(row->render);
+    free(row->chars);
+    free(row->hl);
+}
+
+void editorDelRow(int at) {
+    if( at < 0 || at >= E.numrows) return;
+    int open = E.row[at].hl_open_comment;
+    editorFreeRow(&E.row[at]);
+    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
+    for(int j = at; j < E.numrows - 1; j++) E.row[j].idx--;
+    E.numrows--;
+    editorWrapDelete(at);
+    rowIndexDelete(&E.byteindex, at);
+    bracketIndexSplice(&E.brackets, at, 1, 0);
+    // The next row was highlighted after the deleted one
+    if(at < E.numrows && (at > 0 && E.row[at - 1].hl_open_comment) != open)
+	editorUpdateSyntax(&E.row[at]);
+    editorMarkChanged(at, 0);
+}
+
+// Replaces rows [at, at + deln) with insn rows using a single memmove of
+// E.row instead of a row at a time. The new rows only need chars and size,
+// render and highlighting are built here. Deleted rows are handed over to
+// removed when it's given and freed otherwise
+void editorSpliceRows(int at, int deln, erow *ins, int insn, erow *removed) {
+    int j;
+    if(removed) memcpy(removed, &E.row[at], sizeof(erow) * deln);
+    else for(j = 0; j < deln; j++) editorFreeRow(&E.row[at + j]);
+
+    if(insn > deln)
+	E.row = realloc(E.row, sizeof(erow) * (E.numrows - deln + insn));
+    memmove(&E.row[at + insn], &E.row[at + deln],
+	    sizeof(erow) * (E.numrows - at - deln));
+    E.numrows += insn - deln;
+
+    for(j = 0; j < insn; j++) {
+	erow *row = &E.row[at + j];
+	row->size = ins[j].size;
+	row->chars = ins[j].chars;
+	row->rsize = 0;
+	row->render = NULL;
+	row->hl = NULL;
+	row->hl_open_comment = 0;
+	memset(&row->brackets, 0, sizeof(struct bracketSum));
+	row->brackets_stale = 0;
+    }
+    for(j = at; j < E.numrows; j++) E.row[j].idx = j;
+
+    editorWrapSplice(at, deln, insn);
+    rowIndexSplice(&E.byteindex, at, deln, insn);
+    bracketIndexSplice(&E.brackets, at, deln, insn);
+    for(j = 0; j < insn; j++) editorUpdateRender(&E.row[at + j]);
+    // The row after a deletion follows a different row now, so it is
+    // highlighted again as well
+    editorUpdateSyntaxRange(at, at + insn);
+    editorMarkChanged(at, insn);
+}
+
+// Replaces rows [at, at + oldn) with newn rows that were moved around rather
+// than edited, taking over the ones given. A moved row keeps its render and
+// highlighting unless the comment state it starts in changed, oldin has
+// the state it started in before, or -1 for rows that only have chars
+void editorPlaceRows(int at, int oldn, erow *rows, int newn, signed char *oldin) {
+    int end = oldn ? E.row[at + oldn - 1].hl_open_comment :
+	at > 0 && E.row[at - 1].hl_open_comment;
+    if(newn > oldn)
+	E.row = realloc(E.row, sizeof(erow) * (E.numrows - oldn + newn));
+    memmove(&E.row[at + newn], &E.row[at + oldn],
+	    sizeof(erow) * (E.numrows - at - oldn));
+    memcpy(&E.row[at], rows, sizeof(erow) * newn);
+    E.numrows += newn - oldn;
+    int j;
+    for(j = at; j < (newn == oldn ? at + newn : E.numrows); j++) E.row[j].idx = j;
+
+    for(j = 0; j < newn; j++) {
+	erow *row = &E.row[at + j];
+	if(oldin[j] != -1) continue;
+	row->rsize = 0;
+	row->render = NULL;
+	row->hl = NULL;
+	row->hl_open_comment = 0;
+	memset(&row->brackets, 0, sizeof(struct bracketSum));
+	row->brackets_stale = 0;
+    }
+    // Rows that only have chars are measured again once rendered
+    editorWrapSplice(at, oldn, newn);
+    rowIndexSplice(&E.byteindex, at, oldn, newn);
+    for(j = 0; j < newn; j++) if(oldin[j] == -1) editorUpdateRender(&E.row[at + j]);
+    bracketIndexSplice(&E.brackets, at, oldn, newn);
+    for(j = 0; j < newn; j++) {
+	erow *row = &E.row[at + j];
+	int in = at + j > 0 && E.row[at + j - 1].hl_open_comment;
+	if(oldin[j] != in) editorHighlightRow(row);
+    }
+    // The row after the range starts where the last one ends
+    int last = newn ? E.row[at + newn - 1].hl_open_comment :
+	at > 0 && E.row[at - 1].hl_open_comment;
+    if(at + newn < E.numrows && last != end) editorUpdateSyntax(&E.row[at + newn]);
+    editorMarkChanged(at, newn);
+}
+
+void editorRowInsertChar(erow *row, int at, int c) {
+    if (at < 0 || at > row->size) at = row->size;
+    row->chars = realloc(row->chars, row->size + 2);
+    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
+    row->size++;
+    row->chars[at] = c;
+    editorUpdateRow(row);
+    editorMarkChanged(row->idx, 1);
+}
+
+void editorRowAppendString(erow *row, char *s, size_t len) {
+    row->chars = realloc(row->chars, row->size + len + 1);
+    memcpy(&row->chars[row->size], s, len);
+    row->size += len;
+    row->chars[row->size] = '\0';
+    editorUpdateRow(row);
+    editorMarkChanged(row->idx, 1);
+}
+
+void editorRowDelChar(erow *row, int at) {
+    if(at < 0 || at >= row->size) return;
+    memmove(&row->chars[at], &row->chars[at+1], row->size - at);
+    row->size--;
+    editorUpdateRow(row);
+    editorMarkChanged(row->idx, 1);
+}
+
+/*** undo ***/
+
+void editorUndoFreeStep(struct undoStep *u) {
+    // A sort only saves the rows it dropped
+    int saved = u->perm ? u->oldn - u->newn : u->oldn, j;
+    for(j = 0; j < saved; j++) free(u->rows[j].chars);
+    free(u->rows);
+    free(u->idx);
+    free(u->perm);
+}
+
+void editorUndoClear() {
+    while (E.undolen) editorUndoFreeStep(&E.undo[--E.undolen]);
+}
+
+// Pushes a step that owns the given rows. The caller fills in newn
+struct undoStep *editorUndoPush(int at, int oldn, erow *rows, int *idx) {
+    if(E.undolen == KILO_UNDO_STEPS) {
+	editorUndoFreeStep(&E.undo[0]);
+	memmove(&E.undo[0], &E.undo[1], sizeof(struct undoStep) * --E.undolen);
+    }
+    if(E.undo == NULL)
+	E.undo = malloc(sizeof(struct undoStep) * KILO_UNDO_STEPS);
+
+    struct undoStep *u = &E.undo[E.undolen++];
+    u->at = at;
+    u->oldn = oldn;
+    u->newn = oldn;
+    u->idx = idx;
+    u->perm = NULL;
+    u->rows = rows;
+    u->cx = E.cx;
+    u->cy = E.cy;
+    u->typing = 0;
+    return u;
+}
+
+// Saves a copy of rows [at, at + n) before they get edited. Typing that
+// keeps touching the same rows goes into the step that is already there,
+// so undo takes back a run of typing at once
+void editorUndoBegin(int at, int n, int typing) {
+    if(typing && E.undolen) {
+	struct undoStep *top = &E.undo[E.undolen - 1];
+	if(top->typing && top->idx == NULL && top->at == at && top->newn == n)
+	    return;
+    }
+
+    erow *rows = malloc(sizeof(erow) * (n ? n : 1));
+    int j;
+    for(j = 0; j < n; j++) {
+	erow *row = &E.row[at + j];
+	rows[j].size = row->size;
+	rows[j].chars = malloc(row->size + 1);
+	memcpy(rows[j].chars, row->chars, row->size + 1);
+    }
+    editorUndoPush(at, n, rows, NULL)->typing = typing;
+}
+
+// Records how many rows the change left in place of the saved ones
+void editorUndoEnd(int newn) {
+    E.undo[E.undolen - 1].newn = newn;
+}
+
+void editorUndo() {
+    if(E.undolen == 0) {
+	editorSetStatusMessage("Nothing to undo");
+	return;
+    }
+    struct undoStep *u = &E.undo[--E.undolen];
+
+    if(u->idx) {
+	int j;
+	for(j = 0; j < u->oldn; j++) {
+	    erow *row = &E.row[u->idx[j]];
+	    free(row->chars);
+	    row->chars = u->rows[j].chars;
+	    row->size = u->rows[j].size;
+	    editorUpdateRender(row);
+	}
+	editorUpdateSyntaxRows(u->idx, u->oldn);
+	editorMarkRows(u->idx, u->oldn);
+	free(u->idx);
+    } else if(u->perm) {
+	// Rows go back where they were, the dropped ones in between
+	int n = u->oldn, kept = u->newn, j;
+	erow *rows = malloc(sizeof(erow) * (n ? n : 1));
+	signed char *oldin = malloc(n ? n : 1);
+	for(j = 0; j < kept; j++) {
+	    int at = u->at + j;
+	    rows[u->perm[j]] = E.row[at];
+	    oldin[u->perm[j]] = at > 0 && E.row[at - 1].hl_open_comment;
+	}
+	for(j = kept; j < n; j++) {
+	    rows[u->perm[j]] = u->rows[j - kept];
+	    oldin[u->perm[j]] = -1;
+	}
+	editorPlaceRows(u->at, kept, rows, n, oldin);
+	free(rows);
+	free(oldin);
+	free(u->perm);
+    } else {
+	editorSpliceRows(u->at, u->newn, u->rows, u->oldn, NULL);
+    }
+    free(u->rows);
+
+    E.cx = u->cx;
+    E.cy = u->cy;
+    editorClampCursor();
+}
+
+/*** editor operations ***/
+
+void editorInsertChar(int c) {
     if(E.cy == E.numrows) {
+	editorUndoBegin(E.cy, 0, 1);
 	editorInsertRow(E.numrows, "", 0);
+    } else {
+	editorUndoBegin(E.cy, 1, 1);
+    }
+    editorRowInsertChar(&E.row[E.cy], E.cx, c);
+    editorUndoEnd(1);
+    E.cx++;
+}
+
+void editorInsertNewline() {
+    int n = E.cy < E.numrows;
+    editorUndoBegin(E.cy, n, 1);
+    if (E.cx == 0) {
+	editorInsertRow(E.cy, "", 0);
+    } else {
+	erow *row = &E.row[E.cy];
+	editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+	row = &E.row[E.cy];
+	row->size = E.cx;
+	row->chars[row->size] = '\0';
+	editorUpdateRow(row);
+	editorMarkChanged(E.cy, 1);
+    }
+    editorUndoEnd(n + 1);
+    E.cy++;
+    E.cx = 0;
+}
+
+void editorDelChar() {
+    if(E.cy == E.numrows) return;
+    if(E.cx == 0 && E.cy == 0) return;
+
+    erow *row = &E.row[E.cy];
+    if(E.cx > 0) {
+	editorUndoBegin(E.cy, 1, 1);
+	editorRowDelChar(row, E.cx - 1);
+	editorUndoEnd(1);
+	E.cx--;
+    } else {
+	editorUndoBegin(E.cy - 1, 2, 1);
+	E.cx = E.row[E.cy - 1].size;
+	editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
+	editorDelRow(E.cy);
+	editorUndoEnd(1);
+	E.cy--;
+    }
+}
+/*** file i/o ***/
+void editorOpen(char* filename) {
+    free(E.filename);
+    E.filename = strdup(filename);
+    // strdup comes from string.h copy of a given string and allocating req
+    // memory and assuming you will free that memory
+
+    editorSelectSyntaxHighlight();
+
+    struct editorCodec *codec = editorFileCodec(filename);
+    if(codec) {
+	editorOpenCompressed(codec);
+	return;
+    }
+    if(E.hexopen || editorIsBinary(filename)) {
+	editorOpenHex(filename);
+	return;
+    }
+
+    FILE *fp = fopen(filename, "r");
+    if (!fp) die("fopen");
+    struct stat st;
+    if(fstat(fileno(fp), &st) == -1) die("fstat");
+
+    // Rows are collected first so the session cache can decide whether
+    // they need highlighting
+    erow *rows = NULL;
+    unsigned long long *hash = NULL;
+    int n = 0, cap = 0;
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    long long kept = 0; // What the rows write back out
+    E.tailoff = 0;
+    E.tailpartial = 0;
+    while ((linelen = getline(&line, &linecap, fp)) != -1 ) {
+	E.tailoff += linelen;
+	E.tailpartial = line[linelen - 1] != '\n';
+	while (linelen > 0 && (line[linelen - 1] == '\n' ||
+			       line[linelen - 1] == '\r'))
+	    linelen--;
+	if(n == cap) {
+	    cap = cap ? cap * 2 : 1024;
+	    rows = realloc(rows, sizeof(erow) * cap);
+	    hash = realloc(hash, sizeof(unsigned long long) * cap);
+	}
+	rows[n].size = linelen;
+	rows[n].chars = malloc(linelen + 1);
+	memcpy(rows[n].chars, line, linelen);
+	rows[n].chars[linelen] = '\0';
+	hash[n] = editorRowHash(&rows[n]);
+	kept += linelen + 1;
+	n++;
+    }
+    free(line);
+    fclose(fp);
+    // The session cache is checked against the line hashes
+    free(E.diskhash);
+    E.diskhash = hash ? hash : malloc(sizeof(unsigned long long));
+    E.disklines = n;
+    E.diskexact = !E.tailpartial && kept == E.tailoff;
+    editorSessionLoad(rows, n, &st);
+    free(rows);
+    E.changelo = -1;
+    E.dirty = 0;
+    editorWatchFile();
+}
+
+// Writes the rows over the file. While the file is still what the line
+// hashes describe, writing starts at the first row that changed, and stops
+// after the last one when the file keeps its length. Returns the bytes
+// written, with the offset they went to in at, or -1
+long long editorWriteFile(long long *at) {
+    int from = 0, to = E.numrows, resize = 1;
+    long long total = rowIndexTotal(&E.byteindex);
+    struct stat st;
+    if(E.diskhash && E.diskexact && stat(E.filename, &st) == 0 &&
+	    st.st_ino == E.disk.st_ino && st.st_size == E.disk.st_size &&
+	    st.st_mtim.tv_sec == E.disk.st_mtim.tv_sec &&
+	    st.st_mtim.tv_nsec == E.disk.st_mtim.tv_nsec) {
+	editorNarrowChanges();
+	int clean = E.changelo == -1;
+	from = clean ? E.numrows : E.changelo;
+	// The rows after the change are already where they belong
+	if(total == st.st_size) {
+	    to = clean ? E.numrows : E.numrows - E.changetail;
+	    resize = 0;
+	}
+    }
+    *at = rowIndexSum(&E.byteindex, from);
+
+    int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
+    if(fd == -1) return -1;
+    // Rows go out straight from their chars, same as to a pipe
+    struct pipeJob job;
+    memset(&job, 0, sizeof(struct pipeJob));
+    job.in = fd;
+    job.row = from;
+    job.endrow = to;
+    int r = -1;
+    if(lseek(fd, *at, SEEK_SET) != -1)
+	while ((r = pipeWriteRows(&job)) == 1);
+    if(r == 0 && resize && ftruncate(fd, total) == -1) r = -1;
+    close(fd);
+    if(r == -1) return -1;
+    E.tailoff = total;
+    E.tailpartial = 0;
+    editorDiskSaved();
+    return job.written;
+}
+
+void editorSaveAnswer(char *filename, void *data) {
+    (void) data;
+    if(filename == NULL) {
+	editorSetStatusMessage("Save aborted");
+	return;
+    }
+    // Someone else may have named it in the meantime
+    free(E.filename);
+    E.filename = filename;
+    editorSelectSyntaxHighlight();
+    editorSave();
+}
+
+void editorSave() {
+    if(E.filename == NULL){
+	editorPrompt("Save as: %s", NULL, editorSaveAnswer, NULL);
+	return;
+    }
+    if(E.evicted) {
+	editorSetStatusMessage("Can't save, follow mode dropped the first %lld lines",
+		E.evicted);
+	return;
+    }
+    struct editorCodec *codec = editorFileCodec(E.filename);
+    if(codec) {
+	if(editorBusy())
+	    editorSetStatusMessage("Can't save while another terminal's %s runs",
+		    editorBusy()->what);
+	else
+	    editorSaveCompressed(codec);
+	return;
+    }
+    long long at;
+    long long bytes = editorWriteFile(&at);
+    if(bytes == -1) {
+	editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+	return;
+    }
+    // Our own write isn't a change on disk
+    if(E.watchfd == -1) editorWatchFile();
+    else stat(E.filename, &E.disk);
+    // The session cache entry waits for quitting, it would go over every
+    // row and a save only goes over the changed ones
+    if(at) editorSetStatusMessage("%lld bytes written to disk at offset %lld", bytes, at);
+    else editorSetStatusMessage("%lld bytes written to disk", bytes);
+}
+/*** external changes ***/
+
+// Watches the directory rather than the file, so that a file replaced by
+// a rename is still seen
+void editorWatchFile() {
+    if(E.watchfd != -1) close(E.watchfd);
+    E.watchfd = -1;
+    E.diskchanged = 0;
+    if(stat(E.filename, &E.disk) == -1) memset(&E.disk, 0, sizeof(E.disk));
+    // Compressed files would have to be decompressed whole to diff them, so
+    // they aren't reloaded or followed
+    if(editorFileCodec(E.filename)) return;
+
+    char *slash = strrchr(E.filename, '/');
+    char *dir = slash ? strndup(E.filename, slash - E.filename + 1) : strdup(".");
+    E.watchfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(E.watchfd != -1 && inotify_add_watch(E.watchfd, dir,
+		IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) == -1) {
+	close(E.watchfd);
+	E.watchfd = -1;
+    }
+    free(dir);
+}
+
+unsigned long long editorHashLine(const char *s, int len) {
+    // FNV-1a
+    unsigned long long h = 14695981039346656037ULL;
+    int j;
+    for(j = 0; j < len; j++) {
+	h ^= (unsigned char) s[j];
+	h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// A file read into one buffer and split into lines the way editorOpen
+// splits it
+struct diskLines {
+    char *buf;
+    char **line;
+    int *len;
+    int n;
+    size_t size;
+};
+
+int editorReadLines(const char *path, struct diskLines *dl) {
+    memset(dl, 0, sizeof(struct diskLines));
+    int fd = open(path, O_RDONLY);
+    if(fd == -1) return -1;
+    size_t cap = 65536, len = 0;
+    dl->buf = malloc(cap);
+    ssize_t n;
+    while ((n = read(fd, &dl->buf[len], cap - len)) > 0) {
+	len += n;
+	if(len == cap) dl->buf = realloc(dl->buf, cap *= 2);
+    }
+    close(fd);
+    if(n == -1) {
+	free(dl->buf);
+	return -1;
+    }
+
+    dl->size = len;
+    int linecap = 0;
+    char *p = dl->buf, *end = dl->buf + len;
+    while (p < end) {
+	char *nl = memchr(p, '\n', end - p);
+	int l = (nl ? nl : end) - p;
+	while (l > 0 && (p[l - 1] == '\r' || p[l - 1] == '\n')) l--;
+	if(dl->n == linecap) {
+	    linecap = linecap ? linecap * 2 : 1024;
+	    dl->line = realloc(dl->line, sizeof(char *) * linecap);
+	    dl->len = realloc(dl->len, sizeof(int) * linecap);
+	}
+	dl->line[dl->n] = p;
+	dl->len[dl->n++] = l;
+	p = nl ? nl + 1 : end;
+    }
+    return 0;
+}
+
+void editorFreeLines(struct diskLines *dl) {
+    free(dl->buf);
+    free(dl->line);
+    free(dl->len);
+}
+
+// Myers' diff over line hashes. Sets from[j] to the line of a matching
+// new line b[j], or -1 when it is new. Files that differ in more than
+// KILO_DIFF_MAX lines are left with nothing matched
+void editorDiffLines(unsigned long long *a, int n, unsigned long long *b,
+	int m, int *from) {
+    int j;
+    for(j = 0; j < m; j++) from[j] = -1;
+    int max = n + m < KILO_DIFF_MAX ? n + m : KILO_DIFF_MAX;
+    int off = max + 1;
+    int *v = calloc(2 * max + 3, sizeof(int));
+    int **trace = malloc(sizeof(int *) * (max + 1));
+    int d, k, found = -1, rounds;
+
+    for(d = 0; d <= max && found == -1; d++) {
+	// The furthest x reached on every diagonal before this round, which
+	// is what finding the way back needs
+	trace[d] = malloc(sizeof(int) * (2 * d + 3));
+	memcpy(trace[d], &v[off - d - 1], sizeof(int) * (2 * d + 3));
+	for(k = -d; k <= d; k += 2) {
+	    int x;
+	    if(k == -d || (k != d && v[off + k - 1] < v[off + k + 1]))
+		x = v[off + k + 1];
+	    else
+		x = v[off + k - 1] + 1;
+	    int y = x - k;
+	    while (x < n && y < m && a[x] == b[y]) {
+		x++;
+		y++;
+	    }
+	    v[off + k] = x;
+	    if(x >= n && y >= m) {
+		found = d;
+		break;
+	    }
+	}
+    }
+    rounds = d;
+
+    if(found != -1) {
+	int x = n, y = m;
+	for(d = found; d >= 0; d--) {
+	    int *tv = &trace[d][d + 1]; // tv[k] is diagonal k
+	    k = x - y;
+	    int pk = (k == -d || (k != d && tv[k - 1] < tv[k + 1])) ? k + 1 : k - 1;
+	    int px = tv[pk], py = px - pk;
+	    while (x > px && y > py) {
+		x--;
+		y--;
+		from[y] = x;
+	    }
+	    x = px;
+	    y = py;
+	}
+    }
+    for(j = 0; j < rounds; j++) free(trace[j]);
+    free(trace);
+    free(v);
+}
+
+// Where an old row ends up: its new index when it was kept, otherwise just
+// after the kept row before it
+int editorMapRow(int *to, int n, int row) {
+    if(row >= n) return -1;
+    int r;
+    for(r = row; r >= 0; r--)
+	if(to[r] != -1) return r == row ? to[r] : to[r] + 1;
+    return 0;
+}
+
+// Reloads the file, keeping every row that didn't change along with its
+// render and highlighting. Rows are matched by a common prefix and suffix
+// and a diff of line hashes in between, and the new rows array is put
+// together in one pass
+void editorReloadFile() {
+    struct diskLines dl;
+    if(editorReadLines(E.filename, &dl) == -1) {
+	// Whatever is on disk now, it isn't what the line hashes describe
+	editorDiskForget();
+	editorSetStatusMessage("Can't reload: %s", strerror(errno));
+	return;
+    }
+    int oldn = E.numrows, newn = dl.n, j;
+    int *from = malloc(sizeof(int) * (newn ? newn : 1));
+
+    int pre = 0, suf = 0;
+    while (pre < oldn && pre < newn && E.row[pre].size == dl.len[pre] &&
+	    !memcmp(E.row[pre].chars, dl.line[pre], dl.len[pre])) {
+	from[pre] = pre;
+	pre++;
+    }
+    while (suf < oldn - pre && suf < newn - pre) {
+	erow *row = &E.row[oldn - 1 - suf];
+	int l = newn - 1 - suf;
+	if(row->size != dl.len[l] || memcmp(row->chars, dl.line[l], dl.len[l])) break;
+	from[l] = oldn - 1 - suf;
+	suf++;
+    }
+
+    int n = oldn - pre - suf, m = newn - pre - suf;
+    unsigned long long *a = malloc(sizeof(unsigned long long) * (n ? n : 1));
+    unsigned long long *b = malloc(sizeof(unsigned long long) * (m ? m : 1));
+    for(j = 0; j < n; j++) a[j] = editorHashLine(E.row[pre + j].chars, E.row[pre + j].size);
+    for(j = 0; j < m; j++) b[j] = editorHashLine(dl.line[pre + j], dl.len[pre + j]);
+    editorDiffLines(a, n, b, m, &from[pre]);
+    free(a);
+    free(b);
+    for(j = pre; j < pre + m; j++) {
+	if(from[j] == -1) continue;
+	from[j] += pre;
+	// Equal hashes are checked, a collision is just a changed line
+	erow *row = &E.row[from[j]];
+	if(row->size != dl.len[j] || memcmp(row->chars, dl.line[j], dl.len[j]))
+	    from[j] = -1;
+    }
+
+    int *to = malloc(sizeof(int) * (oldn ? oldn : 1));
+    for(j = 0; j < oldn; j++) to[j] = -1;
+    for(j = 0; j < newn; j++) if(from[j] != -1) to[from[j]] = j;
+
+    // Keep the cursor and the top of the screen on the same rows
+    int top = E.wrap ? rowIndexFind(editorWrapIndex(), E.rowoff, NULL) : E.rowoff;
+    int cy = editorMapRow(to, oldn, E.cy);
+    top = editorMapRow(to, oldn, top);
+
+    erow *rows = malloc(sizeof(erow) * (newn ? newn : 1));
+    int *touched = malloc(sizeof(int) * (newn ? newn : 1));
+    int ntouched = 0, changed = 0;
+    for(j = 0; j < newn; j++) {
+	erow *row = &rows[j];
+	if(from[j] != -1) {
+	    *row = E.row[from[j]];
+	    // Rows after a change may follow a different comment state
+	    if(j == 0 ? from[j] != 0 : from[j - 1] != from[j] - 1)
+		touched[ntouched++] = j;
+	    continue;
+	}
+	memset(row, 0, sizeof(erow));
+	row->size = dl.len[j];
+	row->chars = malloc(dl.len[j] + 1);
+	memcpy(row->chars, dl.line[j], dl.len[j]);
+	row->chars[dl.len[j]] = '\0';
+	touched[ntouched++] = j;
+	changed++;
+    }
+    for(j = 0; j < oldn; j++) if(to[j] == -1) editorFreeRow(&E.row[j]);
+    free(E.row);
+    E.row = rows;
+    E.numrows = newn;
+    for(j = 0; j < newn; j++) rows[j].idx = j;
+    editorWrapInvalidate();
+    rowIndexInvalidate(&E.byteindex);
+    E.brackets.stale = 1;
+    for(j = 0; j < newn; j++) if(from[j] == -1) editorUpdateRender(&rows[j]);
+    editorUpdateSyntaxRows(touched, ntouched);
+
+    if(cy == -1) cy = E.numrows;
+    E.cy = cy;
+    editorClampCursor();
+    if(top == -1) top = 0;
+    E.rowoff = E.wrap ? rowIndexSum(editorWrapIndex(), top) : top;
+
+    // The undo steps point at rows that may not be there any more
+    editorUndoClear();
+    E.marky = -1;
+    E.ncursors = 0;
+    E.tailoff = dl.size;
+    E.tailpartial = dl.size && dl.buf[dl.size - 1] != '\n';
+    E.evicted = 0;
+    editorDiskSnapshot();
+    free(from);
+    free(to);
+    free(touched);
+    editorFreeLines(&dl);
+    editorSetStatusMessage("Reloaded from disk, %d line%s changed", changed,
+	    changed == 1 ? "" : "s");
+    if(E.follow) editorFollowEvict();
+}
+
+int editorCheckDiskKey(int c, void *data) {
+    (void) data;
+    if(c == 'y') editorReloadFile();
+    else if(c == 'n' || c == '\x1b') editorKeepChanges();
+    else return 0;
+    return 1;
+}
+
+// Called after the watch fired. Reloads when the file really changed,
+// asking first when there are unsaved changes that would be lost. With a
+// prompt up it waits until that's answered, and with a job reading the
+// buffer until that's done
+void editorCheckDisk() {
+    if(E.prompt || E.pipe || editorBusy()) return;
+    E.diskchanged = 0;
+    struct stat st;
+    if(E.filename == NULL || stat(E.filename, &st) == -1) return;
+    if(st.st_ino == E.disk.st_ino && st.st_size == E.disk.st_size &&
+	    st.st_mtim.tv_sec == E.disk.st_mtim.tv_sec &&
+	    st.st_mtim.tv_nsec == E.disk.st_mtim.tv_nsec)
+	return;
+    // A followed file that only grew is read from where we left off
+    if(E.follow && st.st_ino == E.disk.st_ino && st.st_size >= E.tailoff) {
+	E.disk = st;
+	editorFollowRead();
+	return;
+    }
+    E.disk = st;
+
+    if(E.dirty) {
+	editorAsk(editorCheckDiskKey, NULL, "%s changed on disk. Reload and "
+		"lose your changes? (y/n)", E.filename);
+	return;
+    }
+    editorReloadFile();
+}
+
+// The file changed on disk and the rows stay as they are. The line hashes
+// describe a file that isn't there any more, so the next save writes all
+// of it
+void editorKeepChanges() {
+    // Rows appended from here on wouldn't line up with the file
+    E.follow = 0;
+    editorDiskForget();
+    editorSetStatusMessage("Kept your changes, saving will overwrite the file");
+}
+
+/*** session cache ***/
+// Reopening a file that hasn't changed skips highlighting it. The comment
+// state after every row is kept in $KILO_CACHE_DIR, or ~/.kilo/cache when
+// it's not set, along with the cursor and scroll position. With that any
+// row can be highlighted on its own the first time it is drawn. Entries
+// are keyed by path, size and mtime and checked against a hash of the rows
+// before they are trusted. One that doesn't match is written again
+
+struct sessionHeader {
+    char magic[8];
+    long long size;
+    long long mtime;
+    long long mtime_nsec;
+    unsigned long long hash; // Of the rows, see editorHashLines
+    unsigned long long syntax; // Of what decides the comment state
+    int numrows;
+    int cx, cy;
+    int rowoff, coloff;
+    int wrap;
+    int pathlen; // The path follows, then a bit per row
+};
+
+// Word at a time, so hashing a whole file costs next to nothing next to
+// reading it
+unsigned long long editorHashBytes(unsigned long long h, const char *s,
+	size_t len) {
+    unsigned long long w;
+    for(; len >= 8; s += 8, len -= 8) {
+	memcpy(&w, s, 8);
+	h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+	h ^= h >> 29;
+    }
+    w = (unsigned long long) len << 56;
+    memcpy(&w, s, len);
+    h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+    return h ^ (h >> 29);
+}
+
+// Of the rows through the hashes of the file's lines, which are there
+// whenever the rows are the file. A save doesn't read every row again
+unsigned long long editorHashLines() {
+    return editorHashBytes(E.disklines, (char *) E.diskhash,
+	    sizeof(unsigned long long) * E.disklines);
+}
+
+unsigned long long editorSyntaxHash() {
+    if(E.syntax == NULL) return 0;
+    struct editorSyntax *s = E.syntax;
+    char *parts[] = {s->filetype, s->singleline_comment_start,
+	s->multiline_comment_start, s->multiline_comment_end};
+    unsigned long long h = s->flags + 1;
+    unsigned int j;
+    for(j = 0; j < sizeof(parts) / sizeof(parts[0]); j++)
+	if(parts[j]) h = editorHashBytes(h, parts[j], strlen(parts[j]));
+    return h;
+}
+
+// Where the entry for the current file lives, and the absolute path it's
+// for in *real. NULL when there's nowhere to keep it
+char *editorSessionPath(char **real, int create) {
+    char dir[4096];
+    const char *env = getenv("KILO_CACHE_DIR");
+    if(env) {
+	snprintf(dir, sizeof(dir), "%s", env);
+    } else {
+	const char *home = getenv("HOME");
+	if(home == NULL) return NULL;
+	snprintf(dir, sizeof(dir), "%s/.kilo", home);
+	if(create) mkdir(dir, 0755);
+	snprintf(dir, sizeof(dir), "%s/.kilo/cache", home);
+    }
+    if(create) mkdir(dir, 0755);
+
+    *real = realpath(E.filename, NULL);
+    if(*real == NULL) return NULL;
+    char *path = malloc(strlen(dir) + 32);
+    sprintf(path, "%s/%016llx.session", dir,
+	    editorHashBytes(0, *real, strlen(*real)));
+    return path;
+}
+
+// Reads the entry for the current file, *bits gets the comment states
+int editorSessionRead(struct sessionHeader *h, unsigned char **bits) {
+    char *real;
+    char *path = editorSessionPath(&real, 0);
+    *bits = NULL;
+    if(path == NULL) return 0;
+    FILE *fp = fopen(path, "r");
+    free(path);
+    int ok = 0;
+    if(fp && fread(h, sizeof(*h), 1, fp) == 1 &&
+	    !memcmp(h->magic, KILO_SESSION_MAGIC, 8) && h->numrows >= 0 &&
+	    h->pathlen == (int) strlen(real)) {
+	char *p = malloc(h->pathlen);
+	size_t nbits = ((size_t) h->numrows + 7) / 8;
+	*bits = malloc(nbits ? nbits : 1);
+	// A different file whose path hashed the same isn't ours
+	ok = fread(p, h->pathlen, 1, fp) == 1 && !memcmp(p, real, h->pathlen) &&
+	    fread(*bits, 1, nbits, fp) == nbits;
+	free(p);
+    }
+    if(fp) fclose(fp);
+    free(real);
+    if(!ok) {
+	free(*bits);
+	*bits = NULL;
+    }
+    return ok;
+}
+
+// Writes the entry for the current file. Only a buffer that is what's on
+// disk is written, the states have to describe the file
+void editorSessionSave() {
+    struct stat st;
+    if(E.filename == NULL || E.dirty || E.diskhash == NULL || E.evicted ||
+	    E.hex || editorFileCodec(E.filename) || stat(E.filename, &st) == -1)
+	return;
+    char *real;
+    char *path = editorSessionPath(&real, 1);
+    if(path == NULL) return;
+
+    struct sessionHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, KILO_SESSION_MAGIC, 8);
+    h.size = st.st_size;
+    h.mtime = st.st_mtim.tv_sec;
+    h.mtime_nsec = st.st_mtim.tv_nsec;
+    h.hash = editorHashLines();
+    h.syntax = editorSyntaxHash();
+    h.numrows = E.numrows;
+    h.cx = E.cx;
+    h.cy = E.cy;
+    h.rowoff = E.rowoff;
+    h.coloff = E.coloff;
+    h.wrap = E.wrap;
+    h.pathlen = strlen(real);
+
+    size_t nbits = ((size_t) E.numrows + 7) / 8;
+    unsigned char *bits = calloc(nbits ? nbits : 1, 1);
+    int j;
+    for(j = 0; j < E.numrows; j++)
+	if(E.row[j].hl_open_comment) bits[j / 8] |= 1 << (j % 8);
+
+    // Written next to the entry and renamed over it, so a reader never sees
+    // half of one
+    char *tmp = malloc(strlen(path) + 8);
+    sprintf(tmp, "%s.XXXXXX", path);
+    int fd = mkostemp(tmp, O_CLOEXEC);
+    FILE *fp = fd == -1 ? NULL : fdopen(fd, "w");
+    if(fp) {
+	int ok = fwrite(&h, sizeof(h), 1, fp) == 1 &&
+	    fwrite(real, h.pathlen, 1, fp) == 1 &&
+	    fwrite(bits, 1, nbits, fp) == nbits;
+	if(fclose(fp) == 0 && ok) rename(tmp, path);
+	else unlink(tmp);
+    } else if(fd != -1) {
+	close(fd);
+	unlink(tmp);
+    }
+    free(tmp);
+    free(bits);
+    free(path);
+    free(real);
+}
+
+// Takes over rows read by editorOpen. When the cache has this exact file
+// they go in unhighlighted with their cached comment states, otherwise
+// they're highlighted as usual and the entry is written again
+void editorSessionLoad(erow *rows, int n, struct stat *st) {
+    struct sessionHeader h;
+    unsigned char *bits;
+    int found = editorSessionRead(&h, &bits);
+    int fresh = found && h.size == st->st_size && h.mtime == st->st_mtim.tv_sec &&
+	h.mtime_nsec == st->st_mtim.tv_nsec && h.numrows == n &&
+	h.syntax == editorSyntaxHash() && h.hash == editorHashLines();
+
+    if(!fresh) {
+	editorSpliceRows(E.numrows, 0, rows, n, NULL);
+	E.dirty = 0;
+	editorSessionSave();
+    } else {
+	int j;
+	E.row = realloc(E.row, sizeof(erow) * (E.numrows + n));
+	for(j = 0; j < n; j++) {
+	    erow *row = &E.row[E.numrows + j];
+	    row->idx = E.numrows + j;
+	    row->size = rows[j].size;
+	    row->chars = rows[j].chars;
+	    row->rsize = 0;
+	    row->render = NULL;
+	    row->hl = NULL;
+	    row->hl_open_comment = (bits[j / 8] >> (j % 8)) & 1;
+	    memset(&row->brackets, 0, sizeof(struct bracketSum));
+	    // Counted without keeping the highlighting, see bracketCount
+	    row->brackets_stale = 1;
+	    editorUpdateRender(row);
+	}
+	E.numrows += n;
+	editorWrapInvalidate();
+	rowIndexInvalidate(&E.byteindex);
+	E.brackets.stale = 1;
+    }
+    free(bits);
+
+    // The view comes back even when the file changed, as close as it fits
+    if(found) {
+	E.wrap = h.wrap;
+	E.cy = h.cy < 0 ? 0 : h.cy;
+	E.cx = h.cx < 0 ? 0 : h.cx;
+	editorClampCursor();
+	E.rowoff = h.rowoff < 0 ? 0 : h.rowoff;
+	E.coloff = h.coloff < 0 ? 0 : h.coloff;
+    }
+}
+
+/*** changed rows ***/
+// Every line of the file as it was last read or written has a hash, so
+// the rows can be compared with it without going back to the file. Edits
+// mark the range of rows they touched and the marks are narrowed against
+// the hashes, which clears the modified flag once the rows are the file
+// again and tells saving where the changes start. The hashes are kept per
+// line of the file, not in the rows, as rows move when others go in
+
+unsigned long long editorRowHash(erow *row) {
+    return editorHashBytes(0, row->chars, row->size);
+}
+
+// Rows [at, at + n) changed and the ones after them only moved. Called once
+// E.numrows counts the rows that went in or out
+void editorMarkChanged(int at, int n) {
+    int tail = E.numrows - at - n;
+    if(E.changelo == -1) {
+	E.changelo = at;
+	E.changetail = tail;
+    } else {
+	if(at < E.changelo) E.changelo = at;
+	if(tail < E.changetail) E.changetail = tail;
+    }
+    E.dirty++;
+}
+
+// Rows changed in place, given by index in any order
+void editorMarkRows(int *idx, int n) {
+    int lo = idx[0], hi = idx[0], j;
+    for(j = 1; j < n; j++) {
+	if(idx[j] < lo) lo = idx[j];
+	if(idx[j] > hi) hi = idx[j];
+    }
+    editorMarkChanged(lo, hi - lo + 1);
+}
+
+// Moves the marks in past rows that hash the same as their lines. Each
+// row is only looked at until it stops matching, so typing on one row
+// costs a hash or two of it a frame
+void editorNarrowChanges() {
+    if(E.changelo == -1 || E.diskhash == NULL) return;
+    int n = E.numrows, m = E.disklines;
+    int lo = E.changelo, tail = E.changetail;
+    if(lo > m) lo = m;
+    if(tail > m - lo) tail = m - lo;
+    while (lo < n - tail && lo < m - tail &&
+	    editorRowHash(&E.row[lo]) == E.diskhash[lo])
+	lo++;
+    while (tail < n - lo && tail < m - lo &&
+	    editorRowHash(&E.row[n - 1 - tail]) == E.diskhash[m - 1 - tail])
+	tail++;
+    E.changelo = lo;
+    E.changetail = tail;
+    if(lo + tail == n && lo + tail == m) {
+	E.changelo = -1;
+	E.dirty = 0;
+    }
+}
+
+// The rows are what the file holds now
+void editorDiskSnapshot() {
+    int j;
+    free(E.diskhash);
+    E.diskhash = malloc(sizeof(unsigned long long) * (E.numrows ? E.numrows : 1));
+    for(j = 0; j < E.numrows; j++) E.diskhash[j] = editorRowHash(&E.row[j]);
+    E.disklines = E.numrows;
+    E.diskexact = !E.tailpartial && rowIndexTotal(&E.byteindex) == E.tailoff;
+    E.changelo = -1;
+    E.dirty = 0;
+}
+
+// The rows were just written out. Only the lines between the marks have
+// new hashes, the ones around them are moved over
+void editorDiskSaved() {
+    editorNarrowChanges();
+    if(E.diskhash == NULL) {
+	editorDiskSnapshot();
+	return;
+    }
+    if(E.changelo != -1) {
+	int lo = E.changelo, tail = E.changetail, j;
+	int mid = E.numrows - lo - tail, oldmid = E.disklines - lo - tail;
+	if(mid > oldmid)
+	    E.diskhash = realloc(E.diskhash, sizeof(unsigned long long) * E.numrows);
+	memmove(&E.diskhash[lo + mid], &E.diskhash[lo + oldmid],
+		sizeof(unsigned long long) * tail);
+	for(j = lo; j < lo + mid; j++) E.diskhash[j] = editorRowHash(&E.row[j]);
+	E.disklines = E.numrows;
+    }
+    E.diskexact = 1;
+    E.changelo = -1;
+    E.dirty = 0;
+}
+
+// The rows stopped lining up with the file's lines for good
+void editorDiskForget() {
+    free(E.diskhash);
+    E.diskhash = NULL;
+    E.disklines = 0;
+}
+
+// Follow mode appended the file's next n lines as rows
+void editorDiskAppend(int n) {
+    if(E.diskhash == NULL) return;
+    int j;
+    E.diskhash = realloc(E.diskhash,
+	    sizeof(unsigned long long) * (E.disklines + n ? E.disklines + n : 1));
+    for(j = 0; j < n; j++)
+	E.diskhash[E.disklines + j] = editorRowHash(&E.row[E.numrows - n + j]);
+    E.disklines += n;
+    if(E.changelo != -1) E.changetail += n;
+    // Bytes only line up with the file while nothing before them changed
+    E.diskexact = E.changelo == -1 && !E.tailpartial &&
+	rowIndexTotal(&E.byteindex) == E.tailoff;
+}
+
+// Follow mode read the rest of the file's last line into the last row
+void editorDiskJoinLast() {
+    if(E.diskhash == NULL || E.disklines == 0) return;
+    if(E.changelo != -1 && E.changetail == 0) {
+	editorDiskForget();
+	return;
+    }
+    E.diskhash[E.disklines - 1] = editorRowHash(&E.row[E.numrows - 1]);
+}
+
+/*** find ***/
+
+// The last match is kept in the prompt and drawn highlighted from there
+void editorFindCallback(char *query, int key) {
+    struct editorPrompt *p = E.prompt;
+    int direction = 1;
+
+    if (key == '\r') {
+	return;
+    } else if (key == '\x1b') {
+	E.cx = p->cx;
+	E.cy = p->cy;
+	E.coloff = p->coloff;
+	E.rowoff = p->rowoff;
+	// Another client may have taken those rows away
+	editorClampCursor();
+	return;
+    } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+	direction = 1;
+    } else if (key == ARROW_LEFT || key == ARROW_UP) {
+	direction = -1;
+    } else {
+	p->match = -1;
+    }
+
+    if(p->match >= E.numrows) p->match = -1;
+    if(p->match == -1) direction = 1;
+    int current = p->match;
+
+    int i;
+    for(i = 0; i < E.numrows; i++) {
+	current += direction;
+	if(current == -1) current = E.numrows - 1;
+	else if(current == E.numrows) current = 0;
+
+	erow *row = &E.row[current];
+	char *match = strstr(row->render, query);
+	if(match) {
+	    p->match = current;
+	    p->matchrx = match - row->render;
+	    p->matchlen = strlen(query);
+	    E.cy = current;
+	    E.cx = editorRowRxToCx(row, match - row->render);
+	    E.rowoff = E.numrows;
+	    break;
+	}
+    }
+}
+
+
+void editorFind() {
+    editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback,
+	    NULL, NULL);
+}
+
+/*** replace ***/
+
+struct replaceJob {
+    char *query;
+    int qlen;
+    char *with;
+    int wlen;
+    // Where the match being asked about is, while the prompt is up
+    int row;
+    int col;
+    long long replaced;
+};
+
+// Replaces up to max occurrences of the query in a row from column from on,
+// building the new chars in a single allocation. The old chars are handed
+// to saved for the undo stack and end is set to the column after the last
+// replacement. Highlighting is left to the caller
+int editorRowReplace(struct replaceJob *job, erow *row, int from, int max,
+	erow *saved, int *end) {
+    char *stop = &row->chars[row->size];
+    char *p = &row->chars[from];
+    char *m;
+    int count = 0;
+    while (count < max && (m = memmem(p, stop - p, job->query, job->qlen))) {
+	count++;
+	p = m + job->qlen;
+    }
+    if(count == 0) return 0;
+
+    int size = row->size + count * (job->wlen - job->qlen);
+    char *buf = malloc(size + 1);
+    memcpy(buf, row->chars, from);
+    char *dst = &buf[from];
+    p = &row->chars[from];
+    int k;
+    for(k = 0; k < count; k++) {
+	m = memmem(p, stop - p, job->query, job->qlen);
+	memcpy(dst, p, m - p);
+	dst += m - p;
+	memcpy(dst, job->with, job->wlen);
+	dst += job->wlen;
+	p = m + job->qlen;
+    }
+    *end = dst - buf;
+    memcpy(dst, p, stop - p);
+    buf[size] = '\0';
+
+    saved->chars = row->chars;
+    saved->size = row->size;
+    row->chars = buf;
+    row->size = size;
+    editorUpdateRender(row);
+    return count;
+}
+
+// Replaces every occurrence from (row, col) to the end of the buffer in one
+// pass. Each row is rewritten at most once, the changed rows are highlighted
+// together afterwards and the whole thing is a single undo step
+long long editorReplaceAll(struct replaceJob *job, int row, int col) {
+    erow *saved = NULL;
+    int *idx = NULL;
+    int n = 0, cap = 0;
+    long long total = 0;
+
+    for(; row < E.numrows; row++, col = 0) {
+	erow old;
+	int end;
+	int count = editorRowReplace(job, &E.row[row], col, INT_MAX, &old, &end);
+	if(count == 0) continue;
+	if(n == cap) {
+	    cap = cap ? cap * 2 : 64;
+	    saved = realloc(saved, sizeof(erow) * cap);
+	    idx = realloc(idx, sizeof(int) * cap);
+	}
+	saved[n] = old;
+	idx[n++] = row;
+	total += count;
+    }
+    if(n == 0) return 0;
+
+    editorUpdateSyntaxRows(idx, n);
+    editorUndoPush(idx[0], n, saved, idx);
+    editorMarkRows(idx, n);
+    return total;
+}
+
+void editorReplaceDone(struct replaceJob *job) {
+    editorSetStatusMessage("Replaced %lld occurrence%s", job->replaced,
+	    job->replaced == 1 ? "" : "s");
+    free(job->query);
+    free(job->with);
+    free(job);
+}
+
+// Moves to the next match from where the job is and shows it the same way
+// find does. Returns 0 when there are none left
+int editorReplaceNext(struct replaceJob *job) {
+    while (job->row < E.numrows) {
+	erow *r = &E.row[job->row];
+	char *m = NULL;
+	if(job->col <= r->size)
+	    m = memmem(&r->chars[job->col], r->size - job->col, job->query, job->qlen);
+	if(m == NULL) {
+	    job->row++;
+	    job->col = 0;
+	    continue;
+	}
+	job->col = m - r->chars;
+	E.cy = job->row;
+	E.cx = job->col;
+	E.prompt->match = job->row;
+	E.prompt->matchrx = editorRowCxToRx(r, job->col);
+	E.prompt->matchlen = editorRowCxToRx(r, job->col + job->qlen) -
+	    E.prompt->matchrx;
+	return 1;
+    }
+    return 0;
+}
+
+int editorReplaceKey(int c, void *data) {
+    struct replaceJob *job = data;
+    if(c == 'y' || c == 'n' || c == 'a') {
+	// Another client may have edited the match away, the next one is
+	// asked about instead
+	erow *r = job->row < E.numrows ? &E.row[job->row] : NULL;
+	if(r == NULL || job->col + job->qlen > r->size ||
+		memcmp(&r->chars[job->col], job->query, job->qlen)) {
+	    if(editorReplaceNext(job)) return 0;
+	    c = '\x1b';
+	}
+    }
+
+    if(c == 'y') {
+	erow *saved = malloc(sizeof(erow));
+	int *idx = malloc(sizeof(int));
+	*idx = job->row;
+	editorUndoPush(job->row, 1, saved, idx);
+	editorRowReplace(job, &E.row[job->row], job->col, 1, saved, &job->col);
+	editorUpdateSyntaxRows(idx, 1);
+	editorMarkChanged(job->row, 1);
+	E.cx = job->col;
+	job->replaced++;
+    } else if(c == 'n') {
+	job->col += job->qlen;
+    } else {
+	if(c == 'a') job->replaced += editorReplaceAll(job, job->row, job->col);
+	editorReplaceDone(job);
+	return 1;
+    }
+    if(editorReplaceNext(job)) return 0;
+    editorReplaceDone(job);
+    return 1;
+}
+
+void editorReplaceWithAnswer(char *with, void *data) {
+    char *query = data;
+    if(with == NULL) {
+	free(query);
+	return;
+    }
+    struct replaceJob *job = calloc(1, sizeof(struct replaceJob));
+    job->query = query;
+    job->qlen = strlen(query);
+    job->with = with;
+    job->wlen = strlen(with);
+    job->row = E.cy;
+    job->col = E.cx;
+    editorAsk(editorReplaceKey, job,
+	    "Replace? (y)es (n)o (a)ll remaining (ESC to stop)");
+    if(!editorReplaceNext(job)) {
+	editorPromptEnd();
+	editorReplaceDone(job);
+    }
+}
+
+void editorReplaceAnswer(char *query, void *data) {
+    (void) data;
+    if(query == NULL) return;
+    editorPrompt("Replace with: %s (ESC to cancel)", NULL,
+	    editorReplaceWithAnswer, query);
+    // Replacing with nothing deletes the matches
+    E.prompt->empty = 1;
+}
+
+void editorReplace() {
+    editorPrompt("Replace: %s (ESC to cancel)", NULL, editorReplaceAnswer, NULL);
+}
+
+/*** region ***/
+
+void editorSetMark() {
+    E.markx = E.cx;
+    E.marky = E.cy;
+    editorSetStatusMessage("Mark set");
+}
+
+// The region between the mark and the cursor with the end exclusive.
+// Returns 0 when there is no mark
+int editorGetRegion(int *sy, int *sx, int *ey, int *ex) {
+    if(E.marky < 0) return 0;
+    int my = E.marky, mx = E.markx;
+    if(my > E.numrows) my = E.numrows;
+    if(my < E.numrows && mx > E.row[my].size) mx = E.row[my].size;
+
+    if(my < E.cy || (my == E.cy && mx <= E.cx)) {
+	*sy = my; *sx = mx; *ey = E.cy; *ex = E.cx;
+    } else {
+	*sy = E.cy; *sx = E.cx; *ey = my; *ex = mx;
+    }
+    // The position past the last row is the end of the last row
+    if(*sy == E.numrows) return 0;
+    if(*ey == E.numrows) {
+	*ey = E.numrows - 1;
+	*ex = E.row[*ey].size;
+    }
+    return 1;
+}
+
+// Render columns of a row that are inside the region, for drawing
+int editorRowRegion(erow *row, int *start, int *end) {
+    int sy, sx, ey, ex;
+    if(!editorGetRegion(&sy, &sx, &ey, &ex)) return 0;
+    if(row->idx < sy || row->idx > ey) return 0;
+    *start = row->idx == sy ? editorRowCxToRx(row, sx) : 0;
+    *end = row->idx == ey ? editorRowCxToRx(row, ex) : row->rsize;
+    return 1;
+}
+
+// Copies the region into the clipboard as one buffer
+void editorCopyRegion(int sy, int sx, int ey, int ex) {
+    size_t len = 0;
+    int j;
+    for(j = sy; j <= ey; j++) {
+	int from = j == sy ? sx : 0;
+	int to = j == ey ? ex : E.row[j].size;
+	len += to - from + (j < ey);
+    }
+
+    free(E.clip);
+    E.clip = malloc(len + 1);
+    E.cliplen = len;
+    char *p = E.clip;
+    for(j = sy; j <= ey; j++) {
+	int from = j == sy ? sx : 0;
+	int to = j == ey ? ex : E.row[j].size;
+	memcpy(p, &E.row[j].chars[from], to - from);
+	p += to - from;
+	if(j < ey) *p++ = '\n';
+    }
+}
+
+void editorCopy() {
+    int sy, sx, ey, ex;
+    if(!editorGetRegion(&sy, &sx, &ey, &ex)) {
+	editorSetStatusMessage("No region, set the mark with Ctrl-Space");
+	return;
+    }
+    editorCopyRegion(sy, sx, ey, ex);
+    E.marky = -1;
+    editorSetStatusMessage("Copied %d line%s", ey - sy + 1, ey > sy ? "s" : "");
+}
+
+// Deletes the region. The rows after the first one are moved out of E.row
+// in a single splice straight onto the undo stack, so this costs the
+// number of rows rather than the number of characters
+void editorCut() {
+    int sy, sx, ey, ex;
+    if(!editorGetRegion(&sy, &sx, &ey, &ex)) {
+	editorSetStatusMessage("No region, set the mark with Ctrl-Space");
+	return;
+    }
+    editorCopyRegion(sy, sx, ey, ex);
+
+    erow *saved = malloc(sizeof(erow) * (ey - sy + 1));
+    erow *first = &E.row[sy];
+    erow *last = &E.row[ey];
+    int size = sx + last->size - ex;
+    char *chars = malloc(size + 1);
+    memcpy(chars, first->chars, sx);
+    memcpy(&chars[sx], &last->chars[ex], last->size - ex);
+    chars[size] = '\0';
+    saved[0].chars = first->chars;
+    saved[0].size = first->size;
+    first->chars = chars;
+    first->size = size;
+
+    editorUndoPush(sy, ey - sy + 1, saved, NULL)->newn = 1;
+    if(ey > sy) {
+	editorSpliceRows(sy + 1, ey - sy, NULL, 0, &saved[1]);
+	int j;
+	for(j = 1; j <= ey - sy; j++) {
+	    free(saved[j].render);
+	    free(saved[j].hl);
+	}
+    }
+    editorUpdateRender(&E.row[sy]);
+    editorUpdateSyntax(&E.row[sy]);
+    editorMarkChanged(sy, 1);
+
+    E.cy = sy;
+    E.cx = sx;
+    E.marky = -1;
+    editorSetStatusMessage("Cut %d line%s", ey - sy + 1, ey > sy ? "s" : "");
+}
+
+// Inserts the clipboard at the cursor. The rows it adds go in with one
+// splice of E.row
+void editorPaste() {
+    if(E.clip == NULL) {
+	editorSetStatusMessage("Clipboard is empty");
+	return;
+    }
+
+    int n = E.cy < E.numrows;
+    editorUndoBegin(E.cy, n, 0);
+    if(!n) editorInsertRow(E.numrows, "", 0);
+
+    int lines = 0;
+    char *p = E.clip, *end = E.clip + E.cliplen;
+    while ((p = memchr(p, '\n', end - p))) {
+	lines++;
+	p++;
+    }
+
+    erow *row = &E.row[E.cy];
+    int tail = row->size - E.cx;
+    char *nl = memchr(E.clip, '\n', E.cliplen);
+    int firstlen = nl ? nl - E.clip : (int) E.cliplen;
+
+    // The rest of the cursor row ends up after the last pasted line
+    erow *ins = malloc(sizeof(erow) * (lines ? lines : 1));
+    p = nl ? nl + 1 : end;
+    int j;
+    for(j = 0; j < lines; j++) {
+	char *eol = memchr(p, '\n', end - p);
+	int len = eol ? eol - p : end - p;
+	int extra = (j == lines - 1) ? tail : 0;
+	ins[j].size = len + extra;
+	ins[j].chars = malloc(len + extra + 1);
+	memcpy(ins[j].chars, p, len);
+	memcpy(&ins[j].chars[len], &row->chars[E.cx], extra);
+	ins[j].chars[len + extra] = '\0';
+	p = eol ? eol + 1 : end;
+    }
+
+    int lastlen = lines ? ins[lines - 1].size - tail : 0;
+    int size = E.cx + firstlen + (lines ? 0 : tail);
+    char *chars = malloc(size + 1);
+    memcpy(chars, row->chars, E.cx);
+    memcpy(&chars[E.cx], E.clip, firstlen);
+    if(!lines) memcpy(&chars[E.cx + firstlen], &row->chars[E.cx], tail);
+    chars[size] = '\0';
+    free(row->chars);
+    row->chars = chars;
+    row->size = size;
+    editorUpdateRender(row);
+
+    if(lines) editorSpliceRows(E.cy + 1, 0, ins, lines, NULL);
+    editorUpdateSyntax(&E.row[E.cy]);
+    free(ins);
+    editorMarkChanged(E.cy, 1);
+    editorUndoEnd(lines + 1);
+
+    if(lines) {
+	E.cy += lines;
+	E.cx = lastlen;
+    } else {
+	E.cx += firstlen;
+    }
+}
+
+/*** multiple cursors ***/
+
+void editorAddCursor(int cy, int cx) {
+    if(E.ncursors == E.capcursors) {
+	E.capcursors = E.capcursors ? E.capcursors * 2 : 64;
+	E.cursors = realloc(E.cursors, sizeof(struct cursor) * E.capcursors);
+    }
+    E.cursors[E.ncursors].cx = cx;
+    E.cursors[E.ncursors].cy = cy;
+    E.ncursors++;
+}
+
+int editorCursorCmp(const void *a, const void *b) {
+    const struct cursor *x = a, *y = b;
+    if(x->cy != y->cy) return x->cy < y->cy ? -1 : 1;
+    return x->cx < y->cx ? -1 : x->cx > y->cx;
+}
+
+// Sorts the cursors if asked, merges the ones that ended up in the same
+// place and puts E.cx and E.cy on the primary one again
+void editorNormalizeCursors(int sort) {
+    struct cursor p = E.cursors[E.primary];
+    if(sort) qsort(E.cursors, E.ncursors, sizeof(struct cursor), editorCursorCmp);
+    int j, n = 0;
+    for(j = 0; j < E.ncursors; j++) {
+	if(n && !editorCursorCmp(&E.cursors[n - 1], &E.cursors[j])) continue;
+	E.cursors[n++] = E.cursors[j];
+    }
+    E.ncursors = n;
+    for(j = 0; j < n; j++)
+	if(!editorCursorCmp(&E.cursors[j], &p)) E.primary = j;
+    E.cx = p.cx;
+    E.cy = p.cy;
+    if(E.ncursors == 1) E.ncursors = 0;
+}
+
+// First cursor on row at or after it
+int editorFirstCursor(int at) {
+    int lo = 0, hi = E.ncursors;
+    while (lo < hi) {
+	int mid = (lo + hi) / 2;
+	if(E.cursors[mid].cy < at) lo = mid + 1;
+	else hi = mid;
+    }
+    return lo;
+}
+
+void editorAddCursorsAnswer(char *query, void *data) {
+    (void) data;
+    if(query == NULL) return;
+    int qlen = strlen(query), y;
+    for(y = 0; y < E.numrows; y++) {
+	char *p = E.row[y].chars, *end = p + E.row[y].size, *m;
+	while ((m = memmem(p, end - p, query, qlen))) {
+	    editorAddCursor(y, m - E.row[y].chars);
+	    p = m + qlen;
+	}
+    }
+    free(query);
+    editorAddCursorsDone();
+}
+
+// Puts a cursor on every line of the region at the column of the cursor,
+// or without a region on every match of a search
+void editorAddCursors() {
+    int sy, sx, ey, ex, y;
+    E.ncursors = 0;
+    if(!editorGetRegion(&sy, &sx, &ey, &ex)) {
+	editorPrompt("Add cursors at: %s (ESC to cancel)", NULL,
+		editorAddCursorsAnswer, NULL);
+	return;
+    }
+    int rx = E.cy < E.numrows ? editorRowCxToRx(&E.row[E.cy], E.cx) : 0;
+    for(y = sy; y <= ey; y++)
+	editorAddCursor(y, editorRowRxToCx(&E.row[y], rx));
+    E.marky = -1;
+    editorAddCursorsDone();
+}
+
+void editorAddCursorsDone() {
+    if(E.ncursors == 0) {
+	editorSetStatusMessage("No matches");
+	return;
+    }
+
+    // The primary cursor is the first one from where the cursor was
+    struct cursor here = {E.cx, E.cy};
+    E.primary = E.ncursors - 1;
+    int j;
+    for(j = 0; j < E.ncursors; j++) {
+	if(editorCursorCmp(&E.cursors[j], &here) >= 0) {
+	    E.primary = j;
+	    break;
+	}
+    }
+    int n = E.ncursors;
+    editorNormalizeCursors(0);
+    editorSetStatusMessage("%d cursors, ESC to go back to one", n);
+}
+
+// Applies an insert, backspace or delete to every cursor in one pass. Each
+// touched row is rebuilt once however many cursors it has, the rows are
+// highlighted together and the whole keystroke is one undo step
+void editorCursorsEdit(int key) {
+    int bs = key == BACKSPACE || key == CTRL_KEY('h');
+    int del = key == DEL_KEY;
+    struct cursor *cur = E.cursors;
+    erow *saved = malloc(sizeof(erow) * E.ncursors);
+    int *idx = malloc(sizeof(int) * E.ncursors);
+    int n = 0, k = 0;
+
+    while (k < E.ncursors) {
+	int y = cur[k].cy, last = k;
+	while (last < E.ncursors && cur[last].cy == y) last++;
+	erow *row = &E.row[y];
+	char *buf = malloc(row->size + (last - k) + 1);
+	int src = 0, dst = 0, changed = 0;
+
+	for(; k < last; k++) {
+	    int at = cur[k].cx;
+	    int keep = bs && at > 0 ? at - 1 : at;
+	    memcpy(&buf[dst], &row->chars[src], keep - src);
+	    dst += keep - src;
+	    src = keep;
+	    if(bs && at > 0) {
+		src = at;
+		changed = 1;
+	    } else if(del && at < row->size) {
+		src = at + 1;
+		changed = 1;
+	    } else if(!bs && !del) {
+		buf[dst++] = key;
+		changed = 1;
+	    }
+	    cur[k].cx = dst;
+	}
+	if(!changed) {
+	    free(buf);
+	    continue;
+	}
+	memcpy(&buf[dst], &row->chars[src], row->size - src);
+	dst += row->size - src;
+	buf[dst] = '\0';
+
+	saved[n].chars = row->chars;
+	saved[n].size = row->size;
+	idx[n++] = y;
+	row->chars = buf;
+	row->size = dst;
+	editorUpdateRender(row);
+    }
+
+    if(n == 0) {
+	free(saved);
+	free(idx);
+	return;
+    }
+    editorUpdateSyntaxRows(idx, n);
+    editorMarkRows(idx, n);
+
+    // Typing on the same rows goes into the step that already holds them
+    // as they were before the first keystroke
+    struct undoStep *top = E.undolen ? &E.undo[E.undolen - 1] : NULL;
+    if(top && top->typing && top->idx && top->oldn == n &&
+	    !memcmp(top->idx, idx, sizeof(int) * n)) {
+	int j;
+	for(j = 0; j < n; j++) free(saved[j].chars);
+	free(saved);
+	free(idx);
+    } else {
+	editorUndoPush(idx[0], n, saved, idx)->typing = 1;
+    }
+    editorNormalizeCursors(0);
+}
+
+void editorCursorsMove(int key) {
+    int j;
+    for(j = 0; j < E.ncursors; j++) {
+	struct cursor *c = &E.cursors[j];
+	switch (key) {
+	    case ARROW_LEFT:
+		if(c->cx > 0) c->cx--;
+		break;
+	    case ARROW_RIGHT:
+		if(c->cx < E.row[c->cy].size) c->cx++;
+		break;
+	    case ARROW_UP:
+		if(c->cy > 0) c->cy--;
+		break;
+	    case ARROW_DOWN:
+		if(c->cy < E.numrows - 1) c->cy++;
+		break;
+	    case HOME_KEY:
+		c->cx = 0;
+		break;
+	    case END_KEY:
+		c->cx = E.row[c->cy].size;
+		break;
+	}
+	if(c->cx > E.row[c->cy].size) c->cx = E.row[c->cy].size;
+    }
+    editorNormalizeCursors(key == ARROW_UP || key == ARROW_DOWN);
+}
+
+// Keys while there are several cursors. Returns 0 for keys that are left
+// to editorProcessKeypress, which only know about the primary cursor
+int editorCursorsKey(int c) {
+    switch (c) {
+	case '\x1b':
+	    E.ncursors = 0;
+	    return 1;
+	case ARROW_UP:
+	case ARROW_DOWN:
+	case ARROW_LEFT:
+	case ARROW_RIGHT:
+	case HOME_KEY:
+	case END_KEY:
+	    editorCursorsMove(c);
+	    return 1;
+	case BACKSPACE:
+	case CTRL_KEY('h'):
+	case DEL_KEY:
+	    editorCursorsEdit(c);
+	    return 1;
+	case CTRL_KEY('s'):
+	case CTRL_KEY('l'):
+	case CTRL_KEY('w'):
+	    return 0;
+    }
+    if(c == '\t' || (c < 256 && !iscntrl(c))) {
+	editorCursorsEdit(c);
+	return 1;
+    }
+    E.ncursors = 0;
+    return 0;
+}
+
+/*** pipes ***/
+
+long long editorNowMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Starts cmd through the shell. The child reads from infd and writes to
+// outfd, or to pipes when they are -1. Rows [row, endrow) are what gets
+// written to an input pipe
+int pipeSpawn(struct pipeJob *job, const char *cmd, int infd, int outfd,
+	int row, int endrow) {
+    int inpipe[2] = {-1, -1}, outpipe[2] = {-1, -1};
+    memset(job, 0, sizeof(struct pipeJob));
+    job->in = job->out = job->fd = -1;
+    job->row = job->start = row;
+    job->endrow = endrow;
+    int j;
+    for(j = row; j < endrow; j++) job->total += E.row[j].size + 1;
+
+    if(infd == -1 && pipe(inpipe) == -1) return -1;
+    if(outfd == -1 && pipe(outpipe) == -1) {
+	if(infd == -1) {
+	    close(inpipe[0]);
+	    close(inpipe[1]);
+	}
+	return -1;
+    }
+
+    job->pid = fork();
+    if(job->pid == 0) {
+	dup2(infd == -1 ? inpipe[0] : infd, STDIN_FILENO);
+	dup2(outfd == -1 ? outpipe[1] : outfd, STDOUT_FILENO);
+	int devnull = open("/dev/null", O_WRONLY);
+	if(devnull != -1) dup2(devnull, STDERR_FILENO);
+	if(infd == -1) {
+	    close(inpipe[0]);
+	    close(inpipe[1]);
+	}
+	if(outfd == -1) {
+	    close(outpipe[0]);
+	    close(outpipe[1]);
+	}
+	signal(SIGPIPE, SIG_DFL);
+	execl("/bin/sh", "sh", "-c", cmd, (char *) NULL);
+	_exit(127);
+    }
+
+    if(infd == -1) {
+	close(inpipe[0]);
+	job->in = inpipe[1];
+    }
+    if(outfd == -1) {
+	close(outpipe[1]);
+	job->out = outpipe[0];
+    }
+    if(job->pid == -1) {
+	if(job->in != -1) close(job->in);
+	if(job->out != -1) close(job->out);
+	return -1;
+    }
+    // Our ends never block so that a child that fills its output pipe
+    // while we are still writing its input can't deadlock us
+    if(job->in != -1) {
+	fcntl(job->in, F_SETFL, O_NONBLOCK);
+	fcntl(job->in, F_SETFD, FD_CLOEXEC);
+    }
+    if(job->out != -1) {
+	fcntl(job->out, F_SETFL, O_NONBLOCK);
+	fcntl(job->out, F_SETFD, FD_CLOEXEC);
+    }
+    return 0;
+}
+
+// Writes as many rows as the pipe takes, straight from their chars with one
+// writev. Returns 1 while there is more to write, 0 when done and -1 when
+// the child stopped reading
+int pipeWriteRows(struct pipeJob *job) {
+    struct iovec iov[KILO_PIPE_IOV];
+    int n = 0;
+    int row = job->row, off = job->off;
+    while (n < KILO_PIPE_IOV - 1 && row < job->endrow) {
+	erow *r = &E.row[row];
+	if(off < r->size) {
+	    iov[n].iov_base = &r->chars[off];
+	    iov[n].iov_len = r->size - off;
+	    n++;
+	}
+	iov[n].iov_base = "\n";
+	iov[n].iov_len = 1;
+	n++;
+	row++;
+	off = 0;
+    }
+    if(n == 0) return 0;
+
+    ssize_t w = writev(job->in, iov, n);
+    if(w == -1) return errno == EAGAIN || errno == EINTR ? 1 : -1;
+    job->written += w;
+    while (w > 0) {
+	int left = E.row[job->row].size + 1 - job->off;
+	if(w >= left) {
+	    w -= left;
+	    job->row++;
+	    job->off = 0;
+	} else {
+	    job->off += w;
+	    w = 0;
+	}
+    }
+    return job->row < job->endrow;
+}
+
+void pipeAddRow(struct pipeJob *job, char *s, int len) {
+    // Same as editorOpen, carriage returns before the newline go
+    while (len > 0 && s[len - 1] == '\r') len--;
+    if(job->nrows == job->caprows) {
+	job->caprows = job->caprows ? job->caprows * 2 : 1024;
+	job->rows = realloc(job->rows, sizeof(erow) * job->caprows);
+    }
+    erow *row = &job->rows[job->nrows++];
+    job->got += sizeof(erow) + len + 1;
+    row->size = len;
+    row->chars = malloc(len + 1);
+    memcpy(row->chars, s, len);
+    row->chars[len] = '\0';
+}
+
+// Splits whatever the child has written so far into rows. Returns 1 while
+// there may be more, 0 at end of file and -1 on errors
+int pipeReadRows(struct pipeJob *job) {
+    char buf[KILO_PIPE_CHUNK];
+    while (1) {
+	ssize_t n = read(job->out, buf, sizeof(buf));
+	if(n == -1) return errno == EAGAIN || errno == EINTR ? 1 : -1;
+	if(n == 0) {
+	    if(job->plen) pipeAddRow(job, job->partial, job->plen);
+	    job->plen = 0;
+	    return 0;
+	}
+
+	char *p = buf, *end = buf + n, *nl;
+	while ((nl = memchr(p, '\n', end - p))) {
+	    if(job->plen) {
+		// Finish the line that started in an earlier chunk
+		int len = nl - p;
+		if(job->plen + len > job->pcap) {
+		    job->pcap = job->plen + len;
+		    job->partial = realloc(job->partial, job->pcap);
+		}
+		memcpy(&job->partial[job->plen], p, len);
+		pipeAddRow(job, job->partial, job->plen + len);
+		job->plen = 0;
+	    } else {
+		pipeAddRow(job, p, nl - p);
+	    }
+	    p = nl + 1;
+	}
+	if(p < end) {
+	    int len = end - p;
+	    if(job->plen + len > job->pcap) {
+		job->pcap = (job->plen + len) * 2;
+		job->partial = realloc(job->partial, job->pcap);
+	    }
+	    memcpy(&job->partial[job->plen], p, len);
+	    job->plen += len;
+	}
+    }
+}
+
+void pipeFreeRows(struct pipeJob *job) {
+    int j;
+    for(j = 0; j < job->nrows; j++) free(job->rows[j].chars);
+    free(job->rows);
+    job->rows = NULL;
+    job->nrows = job->caprows = 0;
+}
+
+// Feeds the child and collects its output as far as the pipes allow
+// without blocking, given what poll said about them. Returns 1 while there
+// is more to do
+int pipeStep(struct pipeJob *job, int inev, int outev) {
+    if(job->in != -1 && inev) {
+	int r = (inev & POLLOUT) ? pipeWriteRows(job) : -1;
+	if(r <= 0) {
+	    close(job->in);
+	    job->in = -1;
+	}
+    }
+    if(job->out != -1 && outev) {
+	int r = pipeReadRows(job);
+	if(r <= 0) {
+	    if(r == -1) job->failed = 1;
+	    close(job->out);
+	    job->out = -1;
+	}
+	if(job->max && job->got > job->max) job->failed = 1;
+    }
+    return !job->failed && (job->in != -1 || job->out != -1);
+}
+
+// Shows how far the job got once every KILO_PROGRESS_INTERVAL. Returns 1
+// when the message changed
+int pipeProgress(struct pipeJob *job) {
+    long long now = editorNowMs();
+    if(now - job->last < KILO_PROGRESS_INTERVAL) return 0;
+    job->last = now;
+    if(job->total)
+	editorSetStatusMessage("%s: %lld/%lld KB written, %d rows read (ESC to cancel)",
+		job->what, job->written / 1024, job->total / 1024, job->nrows);
+    else
+	editorSetStatusMessage("%s: %d rows read (ESC to cancel)",
+		job->what, job->nrows);
+    return 1;
+}
+
+// Closes our ends and waits for the child, killing it first when the job
+// failed. Returns the exit status, or -1 when it failed or was cancelled
+int pipeFinish(struct pipeJob *job) {
+    if(job->in != -1) close(job->in);
+    if(job->out != -1) close(job->out);
+    job->in = job->out = -1;
+    free(job->partial);
+    job->partial = NULL;
+    job->plen = job->pcap = 0;
+
+    if(job->failed) kill(job->pid, SIGTERM);
+    int status;
+    while (waitpid(job->pid, &status, 0) == -1 && errno == EINTR);
+    if(job->failed || !WIFEXITED(status)) return -1;
+    return WEXITSTATUS(status);
+}
+
+// Runs the job until both ends are closed, showing progress in the message
+// bar. ESC or Ctrl-C kills the child. Returns the same as pipeFinish
+int pipeRun(struct pipeJob *job, const char *what) {
+    job->what = what;
+    job->last = editorNowMs();
+    int running = job->in != -1 || job->out != -1;
+    while (running) {
+	struct pollfd fds[3];
+	// Polling a negative fd is a no-op
+	fds[0].fd = job->in;
+	fds[0].events = POLLOUT;
+	fds[1].fd = job->out;
+	fds[1].events = POLLIN;
+	fds[2].fd = E.infd;
+	fds[2].events = POLLIN;
+	if(poll(fds, 3, KILO_PROGRESS_INTERVAL) == -1) {
+	    if(errno == EINTR) continue;
+	    job->failed = 1;
+	    break;
+	}
+
+	running = pipeStep(job, fds[0].revents, fds[1].revents);
+	if(fds[2].revents & POLLIN) {
+	    int c = editorReadKey();
+	    if(c == '\x1b' || c == CTRL_KEY('c')) {
+		job->failed = 1;
+		break;
+	    }
+	}
+	if(pipeProgress(job)) editorRefreshScreen();
+    }
+    return pipeFinish(job);
+}
+
+// Runs a job and hands done its exit status, -1 when it failed or was
+// cancelled. A client of a server keeps the job in its view and the
+// server's poll loop moves it along, so the other clients carry on in the
+// meantime. In a terminal it just runs until it's done
+void pipeStart(struct pipeJob *job, const char *what,
+	void (*done)(struct pipeJob *, int), void *data) {
+    job->done = done;
+    job->data = data;
+    if(E.current == -1) {
+	done(job, pipeRun(job, what));
+	return;
+    }
+    job->what = what;
+    job->last = editorNowMs();
+    E.pipe = job;
+}
+
+// Ends the job of the current view, cancelled or done
+void pipeEnd(int cancel) {
+    struct pipeJob *job = E.pipe;
+    E.pipe = NULL;
+    if(cancel) job->failed = 1;
+    job->done(job, pipeFinish(job));
+}
+
+void editorPipeDone(struct pipeJob *job, int status) {
+    char *cmd = job->data;
+    int sy = job->start, oldn = job->endrow - job->start;
+    if(status != 0) {
+	pipeFreeRows(job);
+	if(job->got > job->max)
+	    editorSetStatusMessage("%s sent back more than %d MB of rows, buffer unchanged",
+		    cmd, KILO_PIPE_MAX >> 20);
+	else if(status == -1) editorSetStatusMessage("Pipe cancelled, buffer unchanged");
+	else editorSetStatusMessage("%s exited with %d, buffer unchanged", cmd, status);
+	free(cmd);
+	free(job);
+	return;
+    }
+
+    erow *saved = malloc(sizeof(erow) * (oldn ? oldn : 1));
+    editorUndoPush(sy, oldn, saved, NULL)->newn = job->nrows;
+    editorSpliceRows(sy, oldn, job->rows, job->nrows, saved);
+    int j;
+    for(j = 0; j < oldn; j++) {
+	free(saved[j].render);
+	free(saved[j].hl);
     }
-    editorRowInsertChar(&E.row[E.cy], E.cx, c);
-    E.cx++;
+    free(job->rows);
+
+    editorSetStatusMessage("%d lines piped through %s, %d lines back", oldn,
+	    cmd, job->nrows);
+    free(cmd);
+    free(job);
+    E.cy = sy;
+    E.cx = 0;
+    E.marky = -1;
 }
 
-void editorInsertNewline() {
-    if (E.cx == 0) {
-	editorInsertRow(E.cy, "", 0);
-    } else {
-	erow *row = &E.row[E.cy];
-	editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-	row = &E.row[E.cy];
-	row->size = E.cx;
-	row->chars[row->size] = '\0';
-	editorUpdateRow(row);
+// Replaces the rows in the region, or the whole buffer without a mark,
+// with the output of a shell command. Rows go to the command straight from
+// E.row and come back as new rows, so the buffer is never copied into one
+// string on the way. The replaced rows stay around for undo, so what comes
+// back is capped at KILO_PIPE_MAX rather than growing with the command
+void editorPipeAnswer(char *cmd, void *data) {
+    (void) data;
+    if(cmd == NULL) return;
+    if(editorBusy()) {
+	editorSetStatusMessage("Can't pipe while another terminal's %s runs",
+		editorBusy()->what);
+	free(cmd);
+	return;
     }
-    E.cy++;
-    E.cx = 0;
+    // Taken once the command is in, another client may have changed rows
+    int sy, sx, ey, ex;
+    if(!editorGetRegion(&sy, &sx, &ey, &ex)) {
+	sy = 0;
+	ey = E.numrows - 1;
+    } else if(ex == 0 && ey > sy) {
+	// A region ending at the start of a row doesn't take that row
+	ey--;
+    }
+
+    struct pipeJob *job = malloc(sizeof(struct pipeJob));
+    if(pipeSpawn(job, cmd, -1, -1, sy, ey + 1) == -1) {
+	editorSetStatusMessage("Can't run command: %s", strerror(errno));
+	free(cmd);
+	free(job);
+	return;
+    }
+    job->max = KILO_PIPE_MAX;
+    pipeStart(job, "Piping", editorPipeDone, cmd);
 }
 
-void editorDelChar() {
-    if(E.cy == E.numrows) return;
-    if(E.cx == 0 && E.cy == 0) return;
+void editorPipeRegion() {
+    editorPrompt("Pipe through: %s (ESC to cancel)", NULL, editorPipeAnswer, NULL);
+}
 
-    erow *row = &E.row[E.cy];
-    if(E.cx > 0) {
-	editorRowDelChar(row, E.cx - 1);
-	E.cx--;
-    } else {
-	E.cx = E.row[E.cy - 1].size;
-	editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-	editorDelRow(E.cy);
-	E.cy--;
+/*** follow ***/
+
+// Adds rows read from the end of a followed file in one go. They only go at
+// the end, so the indexes grow by O(log n) a row rather than being rebuilt,
+// and only the new rows get highlighted. Takes over their chars
+void editorAppendRows(erow *ins, int n) {
+    if(n == 0) return;
+    int at = E.numrows, j;
+    E.row = realloc(E.row, sizeof(erow) * (E.numrows + n));
+    for(j = 0; j < n; j++) {
+	erow *row = &E.row[at + j];
+	row->idx = at + j;
+	row->size = ins[j].size;
+	row->chars = ins[j].chars;
+	row->rsize = 0;
+	row->render = NULL;
+	row->hl = NULL;
+	row->hl_open_comment = at + j > 0 && E.row[at + j - 1].hl_open_comment;
+	memset(&row->brackets, 0, sizeof(struct bracketSum));
+	row->brackets_stale = 0;
+	E.numrows++;
+	editorWrapInsert(at + j);
+	rowIndexInsert(&E.byteindex, at + j);
+	bracketIndexSplice(&E.brackets, at + j, 0, 1);
+	editorUpdateRender(row);
     }
+    editorUpdateSyntaxRange(at, at + n - 1);
 }
-/*** file i/o ***/
-char *editorRowsToString(int *buflen) {
-    int totlen = 0;
-    int j;
-    for(j = 0; j < E.numrows; j++)
-	totlen += E.row[j].size + 1;
-    *buflen = totlen;
-
-    char *buf = malloc(totlen);
-    char *p = buf;
-    for(j = 0; j < E.numrows; j++) {
-	memcpy(p, E.row[j].chars, E.row[j].size);
-	p += E.row[j].size;
-	*p = '\n';
-	p++;
+
+// Drops the oldest rows once there are a quarter more than follow mode
+// keeps, so the memmove and index rebuild that costs are paid once every
+// followmax / 4 lines instead of on every line
+void editorFollowEvict() {
+    if(E.followmax <= 0 || E.numrows <= E.followmax + E.followmax / 4) return;
+    int k = E.numrows - E.followmax;
+    int top = E.wrap ? rowIndexFind(editorWrapIndex(), E.rowoff, NULL) : E.rowoff;
+    int dirty = E.dirty;
+    editorSpliceRows(0, k, NULL, 0, NULL);
+    E.dirty = dirty;
+    E.evicted += k;
+    editorDiskForget();
+
+    E.cy = E.cy > k ? E.cy - k : 0;
+    editorClampCursor();
+    top = top > k ? top - k : 0;
+    E.rowoff = E.wrap ? rowIndexSum(editorWrapIndex(), top) : top;
+    // Same as a reload, these point at rows by index
+    editorUndoClear();
+    E.marky = -1;
+    E.ncursors = 0;
+}
+
+// Reads what was appended to the file since tailoff. The view sticks to the
+// end when the cursor was on the last row, like tail -f
+void editorFollowRead() {
+    int fd = open(E.filename, O_RDONLY | O_CLOEXEC);
+    if(fd == -1) return;
+    struct pipeJob job;
+    memset(&job, 0, sizeof(struct pipeJob));
+    job.in = -1;
+    job.out = fd;
+    off_t end = -1;
+    char last = '\n';
+    if(lseek(fd, E.tailoff, SEEK_SET) != -1 && pipeReadRows(&job) == 0)
+	end = lseek(fd, 0, SEEK_CUR);
+    if(end > E.tailoff && pread(fd, &last, 1, end - 1) != 1) end = -1;
+    close(fd);
+    free(job.partial);
+    if(end <= E.tailoff) {
+	pipeFreeRows(&job);
+	return;
     }
 
-    return buf;
+    int stick = E.cy >= E.numrows - 1;
+    erow *rows = job.rows;
+    int n = job.nrows;
+    if(E.tailpartial && n > 0 && E.numrows > 0) {
+	// The last line was still being written, the rest of it comes first
+	erow *row = &E.row[E.numrows - 1];
+	row->chars = realloc(row->chars, row->size + rows[0].size + 1);
+	memcpy(&row->chars[row->size], rows[0].chars, rows[0].size + 1);
+	row->size += rows[0].size;
+	free(rows[0].chars);
+	editorUpdateRender(row);
+	editorUpdateSyntax(row);
+	editorDiskJoinLast();
+	rows++;
+	n--;
+    }
+    editorAppendRows(rows, n);
+    free(job.rows);
+    E.tailoff = end;
+    E.tailpartial = last != '\n';
+    editorDiskAppend(n);
+    editorFollowEvict();
+
+    if(stick && E.numrows > 0) {
+	E.cy = E.numrows - 1;
+	E.cx = 0;
+    }
 }
 
-void editorOpen(char* filename) {
-    free(E.filename);
-    E.filename = strdup(filename);
-    // strdup comes from string.h copy of a given string and allocating req
-    // memory and assuming you will free that memory
+void editorToggleFollow() {
+    if(E.filename == NULL || E.watchfd == -1) {
+	editorSetStatusMessage("No file to follow");
+	return;
+    }
+    E.follow = !E.follow;
+    if(E.follow) {
+	// Catch up with anything written since the last read, forgetting the
+	// mtime makes editorCheckDisk look at the file again
+	E.disk.st_mtim.tv_nsec = -1;
+	editorCheckDisk();
+	editorFollowEvict();
+	E.cy = E.numrows > 0 ? E.numrows - 1 : 0;
+	E.cx = 0;
+    }
+    editorSetStatusMessage(E.follow ? "Following %s" : "Stopped following %s",
+	    E.filename);
+}
 
-    editorSelectSyntaxHighlight();
+/*** compressed files ***/
 
-    FILE *fp = fopen(filename, "r");
-    if (!fp) die("fopen");
+// Streams the file through the decompressor straight into rows, so the
+// decompressed file is never held in one piece
+void editorOpenCompressed(struct editorCodec *codec) {
+    int fd = open(E.filename, O_RDONLY | O_CLOEXEC);
+    if(fd == -1) die("open");
+    struct pipeJob job;
+    int status = -1;
+    if(pipeSpawn(&job, codec->decompress, fd, -1, 0, 0) != -1)
+	status = pipeRun(&job, "Decompressing");
+    close(fd);
+    if(status != 0) {
+	// Saving what we got would overwrite the file with part of it
+	pipeFreeRows(&job);
+	free(E.filename);
+	E.filename = NULL;
+	E.syntax = NULL;
+	editorSetStatusMessage("Can't read through %s", codec->decompress);
+	return;
+    }
+    editorSpliceRows(E.numrows, 0, job.rows, job.nrows, NULL);
+    free(job.rows);
+    editorDiskSnapshot();
+}
 
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-    while ((linelen = getline(&line, &linecap, fp)) != -1 ) {
-	while (linelen > 0 && (line[linelen - 1] == '\n' ||
-			       line[linelen - 1] == '\r'))
-	    linelen--;
-	editorInsertRow(E.numrows, line, linelen);
+void editorSaveCompressedDone(struct pipeJob *job, int status) {
+    char *tmp = job->data;
+    struct stat st;
+    long long bytes = -1;
+    if(status == 0 && fstat(job->fd, &st) == 0 && rename(tmp, E.filename) == 0)
+	bytes = st.st_size;
+    else
+	unlink(tmp);
+    close(job->fd);
+    free(tmp);
+    pipeFreeRows(job);
+    free(job);
+    if(bytes == -1) {
+	editorSetStatusMessage("Can't save through %s",
+		editorFileCodec(E.filename)->compress);
+	return;
     }
-    free(line);
-    fclose(fp);
-    E.dirty = 0;
+    editorDiskSaved();
+    editorSetStatusMessage("%lld bytes written to disk compressed", bytes);
 }
 
-void editorSave() {
-    if(E.filename == NULL){
-	E.filename = editorPrompt("Save as: %s", NULL);
-	if (E.filename == NULL) {
-	    editorSetStatusMessage("Save aborted");
-	    return;
+// Rows are written to the compressor straight from E.row and it writes to a
+// temporary file that replaces the old one once it succeeded
+void editorSaveCompressed(struct editorCodec *codec) {
+    char *tmp = malloc(strlen(E.filename) + 8);
+    sprintf(tmp, "%s.XXXXXX", E.filename);
+    int fd = mkostemp(tmp, O_CLOEXEC);
+    struct pipeJob *job = malloc(sizeof(struct pipeJob));
+    if(fd == -1 || pipeSpawn(job, codec->compress, -1, fd, 0, E.numrows) == -1) {
+	if(fd != -1) {
+	    close(fd);
+	    unlink(tmp);
 	}
-	editorSelectSyntaxHighlight();
+	free(tmp);
+	free(job);
+	editorSetStatusMessage("Can't save through %s", codec->compress);
+	return;
     }
-    int len;
-    char *buf = editorRowsToString(&len);
+    struct stat st;
+    fchmod(fd, stat(E.filename, &st) == 0 ? st.st_mode & 07777 : 0644);
+    job->fd = fd;
+    pipeStart(job, "Compressing", editorSaveCompressedDone, tmp);
+}
 
-    int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-    if(fd != -1) {
-	if(ftruncate(fd, len) != -1) {
-	    if(write(fd, buf, len) == len) {
-		close(fd);
-		free(buf);
-		E.dirty = 0;
-		editorSetStatusMessage("%d bytes written to disk", len);
-		return;
-	    }
-	}
-	close(fd);
+/*** sort ***/
+
+// A row to sort. Comparisons only look at keys, never at the row's chars
+struct sortKey {
+    unsigned long long prefix; // 8 bytes from the sort's offset, big endian so it orders like memcmp
+    int rest; // Bytes of the row from there, 9 standing for more than the prefix
+    int row;
+};
+
+// A slice of keys for one thread, sorted on its own or merged with the
+// slice after it
+struct sortWork {
+    struct sortKey *keys;
+    struct sortKey *tmp;
+    int off;
+    int lo, mid, hi;
+};
+
+// Rows with the same prefix and no more than 8 bytes left are equal, or
+// the shorter one is how the longer one starts. The same prefix with more
+// left is sorted again further on, see editorSortKeys. Equal rows keep
+// their order
+int editorSortCmp(const void *a, const void *b) {
+    const struct sortKey *x = a, *y = b;
+    if(x->prefix != y->prefix) return x->prefix < y->prefix ? -1 : 1;
+    if(x->rest != y->rest) return x->rest < y->rest ? -1 : 1;
+    return x->row < y->row ? -1 : x->row > y->row;
+}
+
+int editorSortEqual(struct sortKey *x, struct sortKey *y) {
+    erow *r = &E.row[x->row], *s = &E.row[y->row];
+    return r->size == s->size && !memcmp(r->chars, s->chars, r->size);
+}
+
+void *sortSlice(void *arg) {
+    struct sortWork *w = arg;
+    int j, k;
+    for(j = w->lo; j < w->hi; j++) {
+	erow *row = &E.row[w->keys[j].row];
+	unsigned long long p = 0;
+	for(k = w->off; k < w->off + 8; k++)
+	    p = p << 8 | (k < row->size ? (unsigned char) row->chars[k] : 0);
+	w->keys[j].prefix = p;
+	w->keys[j].rest = row->size - w->off > 8 ? 9 : row->size - w->off;
     }
-    free(buf);
-    editorSetStatusMessage("Can't save! I/O error: %d", strerror(errno));
+    qsort(&w->keys[w->lo], w->hi - w->lo, sizeof(struct sortKey), editorSortCmp);
+    return NULL;
 }
-/*** find ***/
 
-void editorFindCallback(char *query, int key) {
-    static int last_match = -1;
-    static int direction = 1;
+void *sortMerge(void *arg) {
+    struct sortWork *w = arg;
+    struct sortKey *a = w->keys, *out = w->tmp;
+    int i = w->lo, j = w->mid, k = w->lo;
+    while (i < w->mid && j < w->hi)
+	out[k++] = editorSortCmp(&a[j], &a[i]) < 0 ? a[j++] : a[i++];
+    while (i < w->mid) out[k++] = a[i++];
+    while (j < w->hi) out[k++] = a[j++];
+    return NULL;
+}
 
-    static int saved_hl_line;
-    static char *saved_hl = NULL;
+// Threads that sort along with the main one. They're started by the first
+// sort that wants them and then wait for work, since a sort hands out work
+// for every slice, every round of merges and every run of rows it sorts
+// again
+struct sortPool {
+    pthread_mutex_t lock;
+    pthread_cond_t work; // Signalled when there is work to take
+    pthread_cond_t done; // Signalled when the last piece is done
+    int started; // Threads running, 0 until the first sort wants them
+    void *(*fn)(void *);
+    struct sortWork *w;
+    int n, next; // Pieces of work and the first nobody took yet
+    int pending; // Pieces not done yet
+} sortPool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER, 0, NULL, NULL, 0, 0, 0};
 
-    if(saved_hl) {
-	memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-	free(saved_hl);
-	saved_hl = NULL;
+// Takes pieces of work until there are none left. Called with the lock
+// held, which it drops while running one
+void sortTake(struct sortPool *p) {
+    while (p->next < p->n) {
+	struct sortWork *w = &p->w[p->next++];
+	pthread_mutex_unlock(&p->lock);
+	p->fn(w);
+	pthread_mutex_lock(&p->lock);
+	if(--p->pending == 0) pthread_cond_signal(&p->done);
     }
+}
 
-    if (key == '\r' || key =='\x1b') {
-	last_match = -1;
-	direction = 1;
+void *sortWorker(void *arg) {
+    struct sortPool *p = arg;
+    pthread_mutex_lock(&p->lock);
+    while (1) {
+	while (p->next >= p->n) pthread_cond_wait(&p->work, &p->lock);
+	sortTake(p);
+    }
+    return NULL;
+}
+
+// Runs fn over every piece of work at once, this thread taking pieces as
+// well so the work gets done even when no thread could be started
+void sortRun(void *(*fn)(void *), struct sortWork *w, int n) {
+    struct sortPool *p = &sortPool;
+    if(n == 1) {
+	fn(w);
 	return;
-    } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-	direction = 1;
-    } else if (key == ARROW_LEFT || key == ARROW_UP) {
-	direction = -1;
-    } else {
-	last_match = -1;
-	direction = 1;
     }
+    pthread_mutex_lock(&p->lock);
+    if(p->started == 0) {
+	int j;
+	for(j = 1; j < KILO_SORT_THREADS; j++) {
+	    pthread_t tid;
+	    if(pthread_create(&tid, NULL, sortWorker, p) != 0) break;
+	    pthread_detach(tid);
+	    p->started++;
+	}
+    }
+    p->fn = fn;
+    p->w = w;
+    p->n = p->pending = n;
+    p->next = 0;
+    pthread_cond_broadcast(&p->work);
+    sortTake(p);
+    while (p->pending > 0) pthread_cond_wait(&p->done, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+}
+
+// A power of two, as many as there are CPUs and slices worth a thread
+int editorSortThreads(int n) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int t = 1;
+    while (t * 2 <= KILO_SORT_THREADS && t * 2 <= cpus &&
+	    n / (t * 2) >= KILO_SORT_MIN_ROWS)
+	t *= 2;
+    return t;
+}
+
+// Sorts the rows of keys by their bytes from off on, which they all have
+// at least of. Merge sort over t threads: every thread sorts a slice by
+// prefix, then pairs of slices are merged in parallel until one is left.
+// Runs of rows that the prefix couldn't tell apart are sorted again from
+// where it ended, so a row's chars are read once per 8 bytes rather than
+// once per comparison
+void editorSortKeys(struct sortKey *keys, int n, int off, int t) {
+    if(n < 2) return;
+    // Skip what all of them have in common, log lines tend to start alike
+    erow *first = &E.row[keys[0].row];
+    int common = first->size - off, j, width;
+    for(j = 1; j < n && common > 0; j++) {
+	erow *row = &E.row[keys[j].row];
+	int k = 0, len = row->size - off < common ? row->size - off : common;
+	while (k < len && row->chars[off + k] == first->chars[off + k]) k++;
+	common = k;
+    }
+    off += common;
 
-    if(last_match == -1) direction = 1;
-    int current = last_match;
+    struct sortKey *tmp = malloc(sizeof(struct sortKey) * n), *sorted = keys;
+    struct sortWork w[KILO_SORT_THREADS];
+    int bound[KILO_SORT_THREADS + 1];
+    for(j = 0; j <= t; j++) bound[j] = (long long) n * j / t;
+    for(j = 0; j < t; j++) {
+	w[j].keys = keys;
+	w[j].off = off;
+	w[j].lo = bound[j];
+	w[j].hi = bound[j + 1];
+    }
+    sortRun(sortSlice, w, t);
+    for(width = 1; width < t; width *= 2) {
+	int m = 0;
+	for(j = 0; j < t; j += 2 * width, m++) {
+	    w[m].keys = sorted;
+	    w[m].tmp = sorted == keys ? tmp : keys;
+	    w[m].lo = bound[j];
+	    w[m].mid = bound[j + width];
+	    w[m].hi = bound[j + 2 * width];
+	}
+	sortRun(sortMerge, w, m);
+	sorted = sorted == keys ? tmp : keys;
+    }
+    if(sorted != keys) memcpy(keys, sorted, sizeof(struct sortKey) * n);
+    free(tmp);
 
     int i;
-    for(i = 0; i < E.numrows; i++) {
-	current += direction;
-	if(current == -1) current = E.numrows - 1;
-	else if(current == E.numrows) current = 0;
+    for(i = 0; i < n; i = j) {
+	for(j = i + 1; j < n && keys[j].prefix == keys[i].prefix &&
+		keys[j].rest == keys[i].rest; j++);
+	if(j - i > 1 && keys[i].rest > 8)
+	    editorSortKeys(&keys[i], j - i, off + 8, editorSortThreads(j - i));
+    }
+}
 
-	erow *row = &E.row[current];
-	char *match = strstr(row->render, query);
-	if(match) {
-	    last_match = current;
-	    E.cy = current;
-	    E.cx = editorRowRxToCx(row, match - row->render);
-	    E.rowoff = E.numrows;
+// Sorts the rows in the region, or the whole buffer without a mark. Rows
+// are moved rather than copied and keep their highlighting unless the
+// comment state they start in changed. unique also drops rows equal to the
+// one before them
+void editorSortLines(int unique) {
+    int sy, sx, ey, ex;
+    if(!editorGetRegion(&sy, &sx, &ey, &ex)) {
+	sy = 0;
+	ey = E.numrows - 1;
+    } else if(ex == 0 && ey > sy) {
+	// A region ending at the start of a row doesn't take that row
+	ey--;
+    }
+    int n = ey - sy + 1, j;
+    if(n <= 0) return;
 
-	    saved_hl_line = current;
-	    saved_hl = malloc(row->rsize);
-	    memcpy(saved_hl, row->hl, row->rsize);
-	    memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-	    break;
+    struct sortKey *keys = malloc(sizeof(struct sortKey) * n);
+    for(j = 0; j < n; j++) keys[j].row = sy + j;
+    editorSortKeys(keys, n, 0, editorSortThreads(n));
+
+    // Undo gets where every kept row came from, then where each dropped
+    // one did along with its chars
+    int *perm = malloc(sizeof(int) * n);
+    int *dropfrom = malloc(sizeof(int) * n);
+    erow *rows = malloc(sizeof(erow) * n);
+    erow *dropped = malloc(sizeof(erow) * n);
+    signed char *oldin = malloc(n);
+    int kept = 0, ndropped = 0;
+    for(j = 0; j < n; j++) {
+	int r = keys[j].row;
+	if(unique && j > 0 && editorSortEqual(&keys[j], &keys[j - 1])) {
+	    free(E.row[r].render);
+	    free(E.row[r].hl);
+	    dropped[ndropped].size = E.row[r].size;
+	    dropped[ndropped].chars = E.row[r].chars;
+	    dropfrom[ndropped++] = r - sy;
+	    continue;
 	}
+	rows[kept] = E.row[r];
+	oldin[kept] = r > 0 && E.row[r - 1].hl_open_comment;
+	perm[kept++] = r - sy;
     }
-}
+    memcpy(&perm[kept], dropfrom, sizeof(int) * ndropped);
+    free(dropfrom);
+    free(keys);
 
+    struct undoStep *u = editorUndoPush(sy, n, dropped, NULL);
+    u->newn = kept;
+    u->perm = perm;
+    editorPlaceRows(sy, n, rows, kept, oldin);
+    free(rows);
+    free(oldin);
 
-void editorFind() {
-    int saved_cx = E.cx;
-    int saved_cy = E.cy;
-    int saved_coloff = E.coloff;
-    int saved_rowoff = E.rowoff;
+    E.cy = sy;
+    E.cx = 0;
+    E.marky = -1;
+    E.ncursors = 0;
+    if(unique)
+	editorSetStatusMessage("%d lines sorted, %d duplicates removed", n, ndropped);
+    else
+	editorSetStatusMessage("%d lines sorted", n);
+}
 
-    char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)",
-	    editorFindCallback);
+/*** goto ***/
 
-    if (query) {
-	free(query);
+// Byte offset of the cursor in the file as it would be saved
+long long editorCursorOffset() {
+    long long off = rowIndexSum(&E.byteindex, E.cy);
+    if(E.cy < E.numrows) off += E.cx;
+    return off;
+}
+
+// Puts the cursor row in the middle of the screen
+void editorCenterCursor() {
+    int top;
+    if(E.wrap) {
+	E.rx = E.cy < E.numrows ? editorRowCxToRx(&E.row[E.cy], E.cx) : 0;
+	top = editorCursorVisualLine() - E.screenrows / 2;
     } else {
-	E.cx = saved_cx;
-	E.cy = saved_cy;
-	E.coloff = saved_coloff;
-	E.rowoff = saved_rowoff;
+	top = E.cy - E.screenrows / 2;
+    }
+    E.rowoff = top < 0 ? 0 : top;
+}
+
+void editorGotoLineAnswer(char *query, void *data) {
+    (void) data;
+    if(query == NULL) return;
+    long long line = strtoll(query, NULL, 10);
+    free(query);
+
+    if(line < 1) line = 1;
+    if(line > E.numrows) line = E.numrows ? E.numrows : 1;
+    E.cy = line - 1;
+    E.cx = 0;
+    editorCenterCursor();
+}
+
+void editorGotoLine() {
+    editorPrompt("Goto line: %s (ESC to cancel)", NULL, editorGotoLineAnswer, NULL);
+}
+
+void editorGotoOffsetAnswer(char *query, void *data) {
+    (void) data;
+    if(query == NULL) return;
+    // Base 0 so that offsets can be pasted in hex as well
+    long long off = strtoll(query, NULL, 0);
+    free(query);
+
+    if(off < 0) off = 0;
+    if(E.hex) {
+	editorHexGoto(off);
+	return;
+    }
+    long long rem;
+    E.cy = rowIndexFind(&E.byteindex, off, &rem);
+    E.cx = (E.cy < E.numrows) ? rem : 0;
+    // An offset on the newline puts the cursor at the end of the row
+    if(E.cy < E.numrows && E.cx > E.row[E.cy].size) E.cx = E.row[E.cy].size;
+    editorCenterCursor();
+}
+
+void editorGotoOffset() {
+    editorPrompt("Goto byte offset: %s (ESC to cancel)", NULL,
+	    editorGotoOffsetAnswer, NULL);
+}
+
+void editorJumpToBracket() {
+    int row, rx;
+    if(E.cy >= E.numrows ||
+	    !editorFindBracketMatch(E.cy, editorRowCxToRx(&E.row[E.cy], E.cx),
+		&row, &rx)) {
+	editorSetStatusMessage("No matching bracket");
+	return;
     }
+    E.cy = row;
+    E.cx = editorRowRxToCx(&E.row[row], rx);
 }
-	    
+
 /*** append buffer ***/
 // If there are many small writes to the screen it'll flicker
 // It's better to make a big write using a write append buffer
@@ -726,21 +4586,335 @@ struct abuf {
     int len;
 };
 
-#define ABUF_INIT {NULL, 0}
+#define ABUF_INIT {NULL, 0}
+
+void abAppend(struct abuf *ab, const char *s, int len) {
+    char *new = realloc(ab->b, ab->len + len);
+    if(new == NULL) return;
+    memcpy(&new[ab->len], s, len);
+    ab->b = new;
+    ab->len += len;
+}
+
+void abFree(struct abuf *ab) {
+    free(ab->b);
+}
+
+/*** hex view ***/
+
+// Binary files are mapped rather than read into rows, and the lines of the
+// dump are formatted from the mapping as they are drawn. Whatever the size
+// of the file, the editor holds a screenful of it. The view is read-only
+
+// Files with a NUL near the start are binary, the same test grep and git use
+int editorIsBinary(const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if(fd == -1) return 0;
+    char buf[KILO_HEX_SNIFF];
+    int n = read(fd, buf, sizeof(buf));
+    close(fd);
+    return n > 0 && memchr(buf, '\0', n) != NULL;
+}
+
+void editorOpenHex(char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if(fd == -1) die("open");
+    struct stat st;
+    if(fstat(fd, &st) == -1) die("fstat");
+    E.hex = 1;
+    E.hexsize = st.st_size;
+    E.hexmap = NULL;
+    // mmap can't map nothing
+    if(st.st_size > 0) {
+	E.hexmap = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(E.hexmap == MAP_FAILED) die("mmap");
+    }
+    close(fd);
+    E.hexcur = 0;
+    E.hextop = 0;
+    E.dirty = 0;
+}
+
+// Hex digits in the offset column, enough for the largest offset
+int editorHexDigits() {
+    int digits = 8;
+    while (digits < 16 && E.hexsize >> (digits * 4)) digits++;
+    return digits;
+}
+
+// Screen column of the first hex digit of byte j of a line
+int editorHexColumn(int j) {
+    return editorHexDigits() + 2 + j * 3 + (j >= KILO_HEX_WIDTH / 2);
+}
+
+// Puts the cursor on byte off, in the middle of the screen
+void editorHexGoto(long long off) {
+    if(off > E.hexsize - 1) off = E.hexsize - 1;
+    if(off < 0) off = 0;
+    E.hexcur = off;
+    E.hextop = off / KILO_HEX_WIDTH * KILO_HEX_WIDTH -
+	(long long) (E.screenrows / 2) * KILO_HEX_WIDTH;
+    if(E.hextop < 0) E.hextop = 0;
+}
+
+void editorHexScroll() {
+    long long line = E.hexcur / KILO_HEX_WIDTH * KILO_HEX_WIDTH;
+    long long screen = (long long) E.screenrows * KILO_HEX_WIDTH;
+    if(line < E.hextop) E.hextop = line;
+    if(line >= E.hextop + screen) E.hextop = line - screen + KILO_HEX_WIDTH;
+}
+
+// Appends what fits on the screen, *col counts the columns used so far
+void editorHexAppend(struct abuf *ab, const char *s, int len, int *col) {
+    if(len > E.screencols - *col) len = E.screencols - *col;
+    if(len <= 0) return;
+    abAppend(ab, s, len);
+    *col += len;
+}
+
+// Whether a byte is part of the match of a search that's up
+int editorHexIsMatch(long long off) {
+    struct editorPrompt *p = E.prompt;
+    return p && p->match != -1 && off >= p->match && off < p->match + p->matchlen;
+}
+
+// One line of the dump: the offset, KILO_HEX_WIDTH bytes in hex and the
+// same bytes as text. A search match is drawn in its own color and the byte
+// under the cursor inverted in the text column
+void editorDrawHexLine(struct abuf *ab, long long off) {
+    char buf[32], color[16];
+    int col = 0, j;
+    int n = E.hexsize - off < KILO_HEX_WIDTH ? E.hexsize - off : KILO_HEX_WIDTH;
+    int clen = snprintf(color, sizeof(color), "\x1b[%dm", editorSyntaxToColor(HL_MATCH));
+    int len = snprintf(buf, sizeof(buf), "%0*llx  ", editorHexDigits(), off);
+    editorHexAppend(ab, buf, len, &col);
+
+    for(j = 0; j < KILO_HEX_WIDTH; j++) {
+	int match = editorHexIsMatch(off + j);
+	if(match) abAppend(ab, color, clen);
+	if(j < n) {
+	    buf[0] = "0123456789abcdef"[E.hexmap[off + j] >> 4];
+	    buf[1] = "0123456789abcdef"[E.hexmap[off + j] & 15];
+	} else {
+	    buf[0] = buf[1] = ' ';
+	}
+	editorHexAppend(ab, buf, 2, &col);
+	if(match) abAppend(ab, "\x1b[39m", 5);
+	editorHexAppend(ab, "  ", j == KILO_HEX_WIDTH / 2 - 1 ? 2 : 1, &col);
+    }
+
+    editorHexAppend(ab, "|", 1, &col);
+    for(j = 0; j < n; j++) {
+	unsigned char c = E.hexmap[off + j];
+	char ch = isprint(c) ? c : '.';
+	int match = editorHexIsMatch(off + j);
+	int cur = off + j == E.hexcur;
+	if(cur) abAppend(ab, "\x1b[7m", 4);
+	if(match) abAppend(ab, color, clen);
+	editorHexAppend(ab, &ch, 1, &col);
+	if(match) abAppend(ab, "\x1b[39m", 5);
+	if(cur) abAppend(ab, "\x1b[27m", 5);
+    }
+    editorHexAppend(ab, "|", 1, &col);
+}
+
+void editorDrawHex(struct abuf *ab) {
+    int y;
+    for(y = 0; y < E.screenrows; y++) {
+	long long off = E.hextop + (long long) y * KILO_HEX_WIDTH;
+	if(off < E.hexsize) editorDrawHexLine(ab, off);
+	else abAppend(ab, "~", 1);
+	abAppend(ab, "\x1b[K", 3);
+	abAppend(ab, "\r\n", 2);
+    }
+}
+
+// The bytes a search is for: pairs of hex digits, with spaces between them
+// if you like, or text in double quotes. Anything that isn't hex is taken
+// as text as well. Returns how many bytes went into out
+int editorHexQuery(const char *query, unsigned char *out) {
+    int n = 0, half = -1;
+    const char *p;
+    if(query[0] == '"') {
+	for(p = query + 1; *p && *p != '"'; p++) out[n++] = *p;
+	return n;
+    }
+    for(p = query; *p; p++) {
+	if(*p == ' ') continue;
+	if(!isxdigit((unsigned char) *p)) {
+	    n = strlen(query);
+	    memcpy(out, query, n);
+	    return n;
+	}
+	int v = isdigit((unsigned char) *p) ? *p - '0' : tolower(*p) - 'a' + 10;
+	if(half == -1) {
+	    half = v;
+	} else {
+	    out[n++] = half << 4 | v;
+	    half = -1;
+	}
+    }
+    // A digit on its own is the start of a byte still being typed
+    return n;
+}
+
+// Offset of the first match of pat at or after from going forward, or at or
+// before it going back, wrapping around the ends of the file. -1 for none
+long long editorHexSearch(unsigned char *pat, int n, long long from, int dir) {
+    unsigned char *m = E.hexmap;
+    long long last = E.hexsize - n; // Last offset a match can start at
+    if(n == 0 || last < 0) return -1;
+    if(from < 0 || from > last) from = dir > 0 ? 0 : last;
+
+    if(dir > 0) {
+	unsigned char *p = memmem(m + from, E.hexsize - from, pat, n);
+	if(p == NULL) p = memmem(m, from + n - 1, pat, n);
+	return p ? p - m : -1;
+    }
+
+    long long at = from, stop = 0;
+    int pass;
+    for(pass = 0; pass < 2; pass++) {
+	while (at >= stop) {
+	    unsigned char *p = memrchr(m + stop, pat[0], at - stop + 1);
+	    if(p == NULL) break;
+	    if(memcmp(p, pat, n) == 0) return p - m;
+	    at = p - m - 1;
+	}
+	// Then back from the end of the file to where we started
+	at = last;
+	stop = from + 1;
+    }
+    return -1;
+}
+
+void editorHexFindCallback(char *query, int key) {
+    struct editorPrompt *p = E.prompt;
+    int direction = 1;
+
+    if(key == '\r') {
+	return;
+    } else if(key == '\x1b') {
+	E.hexcur = p->hexcur;
+	E.hextop = p->hextop;
+	return;
+    } else if(key == ARROW_RIGHT || key == ARROW_DOWN) {
+	direction = 1;
+    } else if(key == ARROW_LEFT || key == ARROW_UP) {
+	direction = -1;
+    } else {
+	p->match = -1;
+    }
+
+    if(p->match >= E.hexsize) p->match = -1;
+    unsigned char *pat = malloc(strlen(query) + 1);
+    int n = editorHexQuery(query, pat);
+    long long from = p->match == -1 ? E.hexcur : p->match + direction;
+    long long at = editorHexSearch(pat, n, from, direction);
+    free(pat);
+    if(at != -1) {
+	p->match = at;
+	p->matchlen = n;
+	editorHexGoto(at);
+    }
+}
+
+void editorHexFind() {
+    editorPrompt("Search bytes: %s (hex or \"text\", ESC/Arrows/Enter)",
+	    editorHexFindCallback, NULL, NULL);
+}
+
+// Keys in the hex view, returns 0 for the ones editorProcessKeypress
+// handles the usual way
+int editorHexKey(int c) {
+    long long page = (long long) E.screenrows * KILO_HEX_WIDTH;
+    switch(c) {
+	case ARROW_LEFT:
+	    E.hexcur--;
+	    break;
+	case ARROW_RIGHT:
+	    E.hexcur++;
+	    break;
+	case ARROW_UP:
+	    if(E.hexcur >= KILO_HEX_WIDTH) E.hexcur -= KILO_HEX_WIDTH;
+	    break;
+	case ARROW_DOWN:
+	    if(E.hexcur + KILO_HEX_WIDTH < E.hexsize) E.hexcur += KILO_HEX_WIDTH;
+	    break;
+	case PAGE_UP:
+	    E.hexcur -= page;
+	    E.hextop -= page;
+	    if(E.hextop < 0) E.hextop = 0;
+	    break;
+	case PAGE_DOWN:
+	    E.hexcur += page;
+	    E.hextop += page;
+	    break;
+	case HOME_KEY:
+	    E.hexcur -= E.hexcur % KILO_HEX_WIDTH;
+	    break;
+	case END_KEY:
+	    E.hexcur += KILO_HEX_WIDTH - 1 - E.hexcur % KILO_HEX_WIDTH;
+	    break;
+	case CTRL_KEY('f'):
+	    editorHexFind();
+	    break;
+	case CTRL_KEY('g'):
+	case CTRL_KEY('b'):
+	    editorGotoOffset();
+	    break;
+	case '\x1b':
+	    break;
+	case CTRL_KEY('q'):
+	case CTRL_KEY('l'):
+	case RESIZE_EVENT:
+	case TIMER_EVENT:
+	case FILE_EVENT:
+	    return 0;
+	default:
+	    editorSetStatusMessage("The hex view is read-only");
+	    break;
+    }
+    if(E.hexcur > E.hexsize - 1) E.hexcur = E.hexsize - 1;
+    if(E.hexcur < 0) E.hexcur = 0;
+    return 1;
+}
+
+/*** output ***/
 
-void abAppend(struct abuf *ab, const char *s, int len) {
-    char *new = realloc(ab->b, ab->len + len);
-    if(new == NULL) return;
-    memcpy(&new[ab->len], s, len);
-    ab->b = new;
-    ab->len += len;
-}
+// Picks up a new terminal size after SIGWINCH. Only the window geometry
+// changes, so the offsets get clamped to the buffer and editorScroll brings
+// the cursor back into view on the same redraw
+void editorRelayout() {
+    E.resized = 0;
 
-void abFree(struct abuf *ab) {
-    free(ab->b);
+    struct winsize ws;
+    if(ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) return;
+    editorResize(ws.ws_row, ws.ws_col);
 }
 
-/*** output ***/
+// Lays the screen out again for a terminal of rows by cols
+void editorResize(int rows, int cols) {
+    rows -= 2;
+    if(rows < 1) rows = 1;
+    if(cols < 1) cols = 1;
+    if(rows == E.screenrows && cols == E.screencols) return;
+
+    // Only the wrap index depends on the width. Keep the row that was at
+    // the top of the screen there
+    if(E.wrap && cols != E.screencols) {
+	long long rem;
+	int top = rowIndexFind(editorWrapIndex(), E.rowoff, &rem);
+	E.screencols = cols;
+	E.rowoff = rowIndexSum(editorWrapIndex(), top);
+    }
+    E.screenrows = rows;
+    E.screencols = cols;
+
+    if(!E.wrap && E.rowoff > E.numrows) E.rowoff = E.numrows;
+    if(E.rowoff < 0) E.rowoff = 0;
+    if(E.coloff < 0) E.coloff = 0;
+}
 
 void editorScroll() {
     E.rx = 0;
@@ -748,6 +4922,15 @@ void editorScroll() {
 	E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
     }
 
+    if(E.wrap) {
+	// Rows never scroll sideways, only visual lines scroll vertically
+	int vline = editorCursorVisualLine();
+	E.coloff = 0;
+	if(vline < E.rowoff) E.rowoff = vline;
+	if(vline >= E.rowoff + E.screenrows) E.rowoff = vline - E.screenrows + 1;
+	return;
+    }
+
     if(E.cy < E.rowoff) {
 	E.rowoff = E.cy;
     }
@@ -762,8 +4945,88 @@ void editorScroll() {
     }
 }
 
+// Render column of cursor *cur if it is on this row and not the primary
+// one, then moves *cur on. Returns -1 past the row's last cursor
+int editorNextCursorRx(erow *row, int *cur) {
+    while (*cur < E.ncursors && E.cursors[*cur].cy == row->idx) {
+	int k = (*cur)++;
+	if(k != E.primary) return editorRowCxToRx(row, E.cursors[k].cx);
+    }
+    return -1;
+}
+
+// Draws len characters of a row's render starting at column at
+void editorDrawRenderSpan(struct abuf *ab, erow *row, int at, int len) {
+    editorEnsureSyntax(row);
+    char *c = &row->render[at];
+    unsigned char *hl = &row->hl[at];
+    int current_color = -1;
+    // The region and the cursors other than the primary one are drawn in
+    // inverted colors
+    int sel_start = 0, sel_end = 0, selected = 0;
+    editorRowRegion(row, &sel_start, &sel_end);
+    int cur = editorFirstCursor(row->idx);
+    int currx = editorNextCursorRx(row, &cur);
+    while (currx != -1 && currx < at) currx = editorNextCursorRx(row, &cur);
+    int j;
+    for(j = 0; j < len; j++) {
+	int in_sel = at + j >= sel_start && at + j < sel_end;
+	if(at + j == currx) {
+	    in_sel = 1;
+	    currx = editorNextCursorRx(row, &cur);
+	}
+	if(in_sel != selected) {
+	    if(in_sel) abAppend(ab, "\x1b[7m", 4);
+	    else abAppend(ab, "\x1b[27m", 5);
+	    selected = in_sel;
+	}
+	if(iscntrl(c[j])) {
+	    char sym = (c[j] <= 26) ? '@' + c[j] : '?';
+	    abAppend(ab, "\x1b[7m", 4);
+	    abAppend(ab, &sym, 1);
+	    abAppend(ab, "\x1b[m", 3);
+	    if(selected) abAppend(ab, "\x1b[7m", 4);
+	    if (current_color != -1) {
+		char buf[16];
+		int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
+		abAppend(ab, buf, clen);
+	    }
+	} else if(hl[j] == HL_NORMAL) {
+	    // m command sets the text color
+	    if(current_color != -1) {
+		abAppend(ab, "\x1b[39m", 5);
+		current_color = -1;
+	    }
+	    abAppend(ab, &c[j], 1);
+	} else {
+	    int color = editorSyntaxToColor(hl[j]);
+	    if(color != current_color) {
+		current_color = color;
+		char buf[16];
+		int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
+		abAppend(ab, buf, clen);
+	    }
+	    abAppend(ab, &c[j], 1);
+	}
+    }
+    if(selected) abAppend(ab, "\x1b[27m", 5);
+    // A cursor at the end of the row sits in the first cell after it
+    if(currx == row->rsize && at + len == currx && len < E.screencols)
+	abAppend(ab, "\x1b[7m \x1b[27m", 10);
+    abAppend(ab, "\x1b[39m", 5);
+}
+
 void editorDrawRows(struct abuf *ab) {
     int y;
+    // With soft wrap rowoff is a visual line, look up which row and which
+    // line of it that is once and walk forward from there
+    int wraprow = 0, wrapline = 0;
+    if(E.wrap) {
+	long long rem;
+	wraprow = rowIndexFind(editorWrapIndex(), E.rowoff, &rem);
+	wrapline = rem;
+    }
+
     for(y = 0; y < E.screenrows; y++) {
 	// Print welcome message
 	// Wrapping row drawing code to check whether we are drawing a row that is part of
@@ -772,7 +5035,7 @@ void editorDrawRows(struct abuf *ab) {
 	// To draw a row that's part of the textbuffer, we write out chars of the erow
 	// but taking care to truncare renderedline if it goes past end of
 	// screen
-	int filerow = y + E.rowoff; // Setting row offset for scrolling
+	int filerow = E.wrap ? wraprow : y + E.rowoff; // Setting row offset for scrolling
 	if (filerow >= E.numrows) {
 	    // Welcome message only displays if text buffer is empty
 	    if(E.numrows == 0 && y == E.screenrows/3) {
@@ -790,46 +5053,23 @@ void editorDrawRows(struct abuf *ab) {
 	    } else {
 		abAppend(ab, "~", 1);
 	    }
+	} else if(E.wrap) {
+	    erow *row = &E.row[filerow];
+	    int at = wrapline * E.screencols;
+	    int len = row->rsize - at;
+	    if(len > E.screencols) len = E.screencols;
+	    editorDrawRenderSpan(ab, row, at, len);
+	    if(++wrapline >= editorRowVisualLines(row)) {
+		wraprow++;
+		wrapline = 0;
+	    }
 	} else {
 	    int len = E.row[filerow].rsize - E.coloff; // Setting col offset
 	    if(len < 0) len = 0;
 	    // If length becomes negative due to coloff, length is set
 	    // to zero so that nothing is printed on screen
 	    if(len > E.screencols) len = E.screencols;
-	    char *c = &E.row[filerow].render[E.coloff];
-	    unsigned char *hl = &E.row[filerow].hl[E.coloff];
-	    int current_color = -1;
-	    int j;
-	    for(j = 0; j < len; j++) {
-		if(iscntrl(c[j])) {
-		    char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-		    abAppend(ab, "\x1b[7m", 4);
-		    abAppend(ab, &sym, 1);
-		    abAppend(ab, "\x1b[m", 3);
-		    if (current_color != -1) {
-			char buf[16];
-			int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-			abAppend(ab, buf, clen);
-		    }
-		} else if(hl[j] == HL_NORMAL) {
-		    // m command sets the text color
-		    if(current_color != -1) {
-			abAppend(ab, "\x1b[39m", 5);
-			current_color = -1;
-		    }
-		    abAppend(ab, &c[j], 1);
-		} else {
-		    int color = editorSyntaxToColor(hl[j]);
-		    if(color != current_color) {
-			current_color = color;
-			char buf[16];
-			int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-			abAppend(ab, buf, clen);
-		    }
-		    abAppend(ab, &c[j], 1);
-		}
-	    }
-	    abAppend(ab, "\x1b[39m", 5);
+	    editorDrawRenderSpan(ab, &E.row[filerow], len ? E.coloff : 0, len);
 	}
 
 
@@ -844,12 +5084,20 @@ void editorDrawRows(struct abuf *ab) {
 void editorDrawStatusBar(struct abuf *ab) {
     abAppend(ab, "\x1b[7m", 4);
     char status[80], rstatus[80];
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-	    E.filename ? E.filename : "[No Name]", E.numrows,
-	    E.dirty? "(modified)" : "");
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
-	    E.syntax ? E.syntax->filetype : "no ft",
-	    E.cy + 1, E.numrows);
+    int len, rlen;
+    if(E.hex) {
+	len = snprintf(status, sizeof(status), "%.20s - %lld bytes (hex)",
+		E.filename, E.hexsize);
+	rlen = snprintf(rstatus, sizeof(rstatus), "hex | @%lld/0x%llx",
+		E.hexcur, E.hexcur);
+    } else {
+	len = snprintf(status, sizeof(status), "%.20s - %d lines %s%s",
+		E.filename ? E.filename : "[No Name]", E.numrows,
+		E.dirty? "(modified)" : "", E.follow ? "(following)" : "");
+	rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d @%lld",
+		E.syntax ? E.syntax->filetype : "no ft",
+		E.cy + 1, E.numrows, editorCursorOffset());
+    }
 
     if (len > E.screencols) len = E.screencols;
     abAppend(ab, status, len);
@@ -872,38 +5120,107 @@ void editorDrawStatusBar(struct abuf *ab) {
 
 void editorDrawMessageBar(struct abuf *ab) {
     abAppend(ab, "\x1b[K", 3);
+    // A prompt stays up until it's answered
+    if(E.prompt) {
+	char msg[sizeof(E.statusmsg)];
+	if(E.prompt->key) snprintf(msg, sizeof(msg), "%s", E.prompt->question);
+	else snprintf(msg, sizeof(msg), E.prompt->fmt, E.prompt->buf);
+	int len = strlen(msg);
+	abAppend(ab, msg, len < E.screencols ? len : E.screencols);
+	return;
+    }
     int msglen = strlen(E.statusmsg);
     if(msglen > E.screencols) msglen = E.screencols;
     // Only append message if time is less than 5 seconds since editor started
     // and after pressing a key
     // since we only refresh screen after single keypress
-    if(msglen && time(NULL) - E.statusmsg_time < 5)
+    if(msglen && time(NULL) - E.statusmsg_time < KILO_STATUS_TIMEOUT)
 	abAppend(ab, E.statusmsg, msglen);
 }
 // Render UI to the screen after each keypress
 void editorRefreshScreen() {
-    editorScroll();
+    if(E.resized) editorRelayout();
+    editorNarrowChanges();
+    if(E.hex) editorHexScroll();
+    else editorScroll();
+
+    // The bracket under the cursor and its match are drawn highlighted for
+    // this frame only
+    unsigned char *match[2] = {NULL, NULL}, saved[2] = {0, 0};
+    int mrow, mrx, j;
+    if(E.cy < E.numrows && editorFindBracketMatch(E.cy, E.rx, &mrow, &mrx)) {
+	match[0] = &E.row[E.cy].hl[E.rx];
+	match[1] = &E.row[mrow].hl[mrx];
+	for(j = 0; j < 2; j++) {
+	    saved[j] = *match[j];
+	    *match[j] = HL_MATCH;
+	}
+    }
+    // So is the match of a search that's up, over the brackets
+    struct editorPrompt *p = E.prompt;
+    unsigned char *found = NULL, *foundhl = NULL;
+    int foundlen = 0;
+    if(!E.hex && p && p->match != -1 && p->match < E.numrows) {
+	erow *row = &E.row[p->match];
+	editorEnsureSyntax(row);
+	foundlen = p->matchrx + p->matchlen > row->rsize ?
+	    row->rsize - p->matchrx : p->matchlen;
+	if(foundlen > 0) {
+	    found = &row->hl[p->matchrx];
+	    foundhl = malloc(foundlen);
+	    memcpy(foundhl, found, foundlen);
+	    memset(found, HL_MATCH, foundlen);
+	}
+    }
 
     struct abuf ab = ABUF_INIT;
     // Hide the cursor when repainting
     abAppend(&ab, "\x1b[?25l", 6);
     abAppend(&ab, "\x1b[H", 3);
     // Escape sequence starts with an escape character followed by [
-    editorDrawRows(&ab);
+    int body = ab.len;
+    if(E.hex) editorDrawHex(&ab);
+    else editorDrawRows(&ab);
     editorDrawStatusBar(&ab);
     editorDrawMessageBar(&ab);
+    int bodylen = ab.len - body;
+    if(found) {
+	memcpy(found, foundhl, foundlen);
+	free(foundhl);
+    }
+    for(j = 1; j >= 0; j--)
+	if(match[j]) *match[j] = saved[j];
 
     char buf[32];
     // Old H command changed to H command with arguments, specifying
     // position we want cursor to move to
     // Add 1 to E.cy and #.cx to convert from 0-index to 1-index of terminal
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", E.cy - E.rowoff + 1,
-	    E.rx - E.coloff + 1);
+    if(E.hex) {
+	int x = editorHexColumn(E.hexcur % KILO_HEX_WIDTH);
+	if(x >= E.screencols) x = E.screencols - 1;
+	snprintf(buf, sizeof(buf), "\x1b[%d;%dH",
+		(int) ((E.hexcur - E.hextop) / KILO_HEX_WIDTH) + 1, x + 1);
+    } else if(E.wrap) {
+	int line = E.cy < E.numrows ? editorWrapLine(&E.row[E.cy], E.rx) : 0;
+	int x = E.rx - line * E.screencols;
+	if(x >= E.screencols) x = E.screencols - 1;
+	snprintf(buf, sizeof(buf), "\x1b[%d;%dH",
+		editorCursorVisualLine() - E.rowoff + 1, x + 1);
+    } else {
+	snprintf(buf, sizeof(buf), "\x1b[%d;%dH", E.cy - E.rowoff + 1,
+		E.rx - E.coloff + 1);
+    }
+    // Clients of a server only get the lines that changed
+    if(E.current != -1) {
+	editorSendFrame(&ab.b[body], bodylen, buf);
+	abFree(&ab);
+	return;
+    }
     abAppend(&ab, buf, strlen(buf));
     // Show cursor when done h and l are used to turn on and off various
     // terminal features
     abAppend(&ab, "\x1b[?25h", 6);
-    write(STDOUT_FILENO, ab.b, ab.len);
+    write(E.outfd, ab.b, ab.len);
     abFree(&ab);
 }
 
@@ -916,40 +5233,99 @@ void editorSetStatusMessage(const char *fmt, ...) {
 }
 /*** input ***/
 
-char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
-    size_t bufsize = 128;
-    char *buf = malloc(bufsize);
+struct editorPrompt *editorPromptNew(void *data) {
+    struct editorPrompt *p = calloc(1, sizeof(struct editorPrompt));
+    p->data = data;
+    p->match = -1;
+    p->cx = E.cx;
+    p->cy = E.cy;
+    p->rowoff = E.rowoff;
+    p->coloff = E.coloff;
+    p->hexcur = E.hexcur;
+    p->hextop = E.hextop;
+    E.prompt = p;
+    return p;
+}
+
+// Asks for a line of text. The keys that follow go to the prompt, callback
+// sees each of them and done gets the line once enter is pressed on it, or
+// NULL for escape. Without done the line is thrown away
+void editorPrompt(const char *fmt, void (*callback)(char *, int),
+	void (*done)(char *, void *), void *data) {
+    struct editorPrompt *p = editorPromptNew(data);
+    p->fmt = fmt;
+    p->cap = 128;
+    p->buf = malloc(p->cap);
+    p->buf[0] = '\0';
+    p->callback = callback;
+    p->done = done;
+}
 
-    size_t buflen = 0;
-    buf[0] = '\0';
+// Asks a question that is answered a key at a time, key gets every key
+// until it returns 1
+void editorAsk(int (*key)(int, void *), void *data, const char *fmt, ...) {
+    struct editorPrompt *p = editorPromptNew(data);
+    p->key = key;
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(p->question, sizeof(p->question), fmt, ap);
+    va_end(ap);
+}
 
-    while(1) {
-	editorSetStatusMessage(prompt, buf);
-	editorRefreshScreen();
+// Takes the prompt down without answering it
+void editorPromptEnd() {
+    struct editorPrompt *p = E.prompt;
+    E.prompt = NULL;
+    free(p->buf);
+    free(p);
+}
 
-	int c = editorReadKey();
-	if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
-	    if (buflen != 0) buf[--buflen] = '\0';
-	} else if (c == '\x1b') {
-	    editorSetStatusMessage("");
-	    if (callback) callback(buf, c);
-	    free(buf);
-	    return NULL;
-	} else if(c == '\r') {
-	    if(buflen != 0) {
-		editorSetStatusMessage("");
-		if (callback) callback(buf, c);
-		return buf;
-	    }
-	} else if (!iscntrl(c) && c < 128) {
-	    if(buflen == bufsize - 1) {
-		bufsize *= 2;
-		buf = realloc(buf, bufsize);
-	    }
-	    buf[buflen++] = c;
-	    buf[buflen] = '\0';
+// A key typed while a prompt is up
+void editorPromptKey(int c) {
+    struct editorPrompt *p = E.prompt;
+    // Nothing typed, just redraw
+    if(c == RESIZE_EVENT || c == TIMER_EVENT || c == FILE_EVENT) return;
+    if(p->key) {
+	if(p->key(c, p->data)) editorPromptEnd();
+	return;
+    }
+
+    if(c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
+	if(p->len != 0) p->buf[--p->len] = '\0';
+    } else if(c == '\x1b' || (c == '\r' && (p->len != 0 || p->empty))) {
+	if(p->callback) p->callback(p->buf, c);
+	// done may well ask something else
+	char *answer = NULL;
+	if(c == '\r') {
+	    answer = p->buf;
+	    p->buf = NULL;
+	}
+	void (*done)(char *, void *) = p->done;
+	void *data = p->data;
+	editorPromptEnd();
+	editorSetStatusMessage("");
+	if(done) done(answer, data);
+	else free(answer);
+	return;
+    } else if(!iscntrl(c) && c < 128) {
+	if(p->len == p->cap - 1) {
+	    p->cap *= 2;
+	    p->buf = realloc(p->buf, p->cap);
 	}
-	if (callback) callback(buf, c);
+	p->buf[p->len++] = c;
+	p->buf[p->len] = '\0';
+    }
+    if(p->callback) p->callback(p->buf, c);
+}
+
+void editorClampCursor() {
+    if(E.cy > E.numrows) E.cy = E.numrows;
+    // Below code is for setting cursor to end character in a row
+    // if the cursor is beyond row length
+    erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    int rowlen = row ? row->size : 0;
+    if (E.cx > rowlen ) {
+	E.cx = rowlen;
     }
 }
 
@@ -986,32 +5362,97 @@ void editorMoveCursor(int key) {
 	    if(E.cy < E.numrows) E.cy++;
 	    break;
     }
-    // Below code is for setting cursor to end character in a row
-    // if the cursor is beyond row length
-    row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
-    int rowlen = row ? row->size : 0;
-    if (E.cx > rowlen ) {
-	E.cx = rowlen;
+    editorClampCursor();
+}
+
+// Keys that only move around or look at the buffer without changing it
+int editorKeyLooks(int c) {
+    switch(c) {
+	case RESIZE_EVENT:
+	case TIMER_EVENT:
+	case FILE_EVENT:
+	case ARROW_UP:
+	case ARROW_DOWN:
+	case ARROW_LEFT:
+	case ARROW_RIGHT:
+	case HOME_KEY:
+	case END_KEY:
+	case PAGE_UP:
+	case PAGE_DOWN:
+	case CTRL_KEY('f'):
+	case CTRL_KEY('w'):
+	case CTRL_KEY(']'):
+	case CTRL_KEY('g'):
+	case CTRL_KEY('b'):
+	case CTRL_KEY('l'):
+	case CTRL_KEY('@'):
+	case CTRL_KEY('c'):
+	case CTRL_KEY('q'):
+	case '\x1b':
+	    return 1;
     }
+    return 0;
 }
 
 void editorProcessKeypress() {
-    static int quit_times = KILO_QUIT_TIMES;
+    // A change on disk seen while a prompt was up is dealt with now
+    if(E.diskchanged) editorCheckDisk();
     int c = editorReadKey();
 
+    // A job only takes being cancelled
+    if(E.pipe) {
+	if(c == '\x1b' || c == CTRL_KEY('c')) pipeEnd(1);
+	return;
+    }
+    // The buffer can only be looked at while another terminal's job reads it
+    struct pipeJob *busy = editorBusy();
+    if(busy && (E.prompt ? E.prompt->key && c != '\x1b' : !editorKeyLooks(c))) {
+	editorSetStatusMessage("%s for another terminal, the buffer can't change until it's done",
+		busy->what);
+	return;
+    }
+    if(E.prompt) {
+	editorPromptKey(c);
+	E.quit_times = KILO_QUIT_TIMES;
+	if(E.diskchanged) editorCheckDisk();
+	return;
+    }
+    if(E.hex && editorHexKey(c)) {
+	E.quit_times = KILO_QUIT_TIMES;
+	return;
+    }
+    if(E.ncursors && c != RESIZE_EVENT && c != TIMER_EVENT && c != FILE_EVENT &&
+	    editorCursorsKey(c)) {
+	E.quit_times = KILO_QUIT_TIMES;
+	return;
+    }
+
     switch(c) {
+	case FILE_EVENT:
+	    editorCheckDisk();
+	    return;
+	case RESIZE_EVENT:
+	case TIMER_EVENT:
+	    // Not a keypress, leave the quit confirmation alone
+	    return;
 	case '\r':
 	    editorInsertNewline();
 	    break;
 	case CTRL_KEY('q'):
-	    if(E.dirty && quit_times > 0) {
+	    // Other terminals still share the buffer, only this one leaves
+	    if(E.nclients > 1) {
+		E.clients[E.current].gone = 1;
+		return;
+	    }
+	    if(E.dirty && E.quit_times > 0) {
 		editorSetStatusMessage("WARNING!!! FILE HAS UNSAVED CHANGES. "
-			"Press Ctrl-Q %d more times to quit.", quit_times);
-		quit_times--;
+			"Press Ctrl-Q %d more times to quit.", E.quit_times);
+		E.quit_times--;
 		return;
 	    }
-	    write(STDOUT_FILENO, "\x1b[2J", 4);
-	    write(STDOUT_FILENO, "\x1b[H", 3);
+	    editorSessionSave();
+	    write(E.outfd, "\x1b[2J", 4);
+	    write(E.outfd, "\x1b[H", 3);
 	    // Reposition cursor on exit so 
 	    // that characters aren't left on screen
 	    exit(0);
@@ -1035,6 +5476,24 @@ void editorProcessKeypress() {
 	case CTRL_KEY('f'):
 	    editorFind();
 	    break;
+	case CTRL_KEY('w'):
+	    editorToggleWrap();
+	    break;
+	case CTRL_KEY(']'):
+	    editorJumpToBracket();
+	    break;
+	case CTRL_KEY('g'):
+	    editorGotoLine();
+	    break;
+	case CTRL_KEY('b'):
+	    editorGotoOffset();
+	    break;
+	case CTRL_KEY('r'):
+	    editorReplace();
+	    break;
+	case CTRL_KEY('z'):
+	    editorUndo();
+	    break;
 	case BACKSPACE:
 	case CTRL_KEY('h'):
 	case DEL_KEY:
@@ -1043,35 +5502,78 @@ void editorProcessKeypress() {
 	    break;
 	case PAGE_UP:
 	case PAGE_DOWN:
-	    {
-		if(c == PAGE_UP) {
-		    E.cy = E.rowoff;
-		} else if (c == PAGE_DOWN) {
-		    E.cy = E.rowoff + E.screenrows - 1;
-		    if(E.cy > E.numrows) E.cy = E.numrows;
-		}
-		int times = E.screenrows;
-		while (times--)
-		    editorMoveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
+	    if(E.wrap) {
+		// A page is a screenful of visual lines, find the row a page
+		// away from the top of the screen in the wrap index
+		long long v = E.rowoff;
+		if(c == PAGE_UP) v -= E.screenrows;
+		else v += 2 * E.screenrows - 1;
+		if(v < 0) v = 0;
+		E.cy = rowIndexFind(editorWrapIndex(), v, NULL);
+		editorClampCursor();
+		break;
+	    }
+	    // Same as moving from the edge of the screen a screenful of
+	    // rows up or down, without going through editorMoveCursor for
+	    // each of them
+	    if(c == PAGE_UP) {
+		E.cy = E.rowoff - E.screenrows;
+		if(E.cy < 0) E.cy = 0;
+	    } else {
+		E.cy = E.rowoff + 2 * E.screenrows - 1;
+		if(E.cy > E.numrows) E.cy = E.numrows;
 	    }
+	    editorClampCursor();
 	    break;
 	// Ctrl-L traditionally used to refresh screen but we're doing that
 	// after every keypress so we don't have to do anything else to implement
 	// that feature
-	// Esc is ignored
 	case CTRL_KEY('l'):
+	    break;
+	// Esc drops the mark
 	case '\x1b':
+	    E.marky = -1;
+	    break;
+	// Ctrl-Space
+	case CTRL_KEY('@'):
+	    editorSetMark();
+	    break;
+	case CTRL_KEY('c'):
+	    editorCopy();
+	    break;
+	case CTRL_KEY('x'):
+	    editorCut();
+	    break;
+	case CTRL_KEY('v'):
+	    editorPaste();
+	    break;
+	case CTRL_KEY('p'):
+	    editorPipeRegion();
+	    break;
+	case CTRL_KEY('n'):
+	    editorAddCursors();
+	    break;
+	case CTRL_KEY('t'):
+	    editorToggleFollow();
+	    break;
+	case CTRL_KEY('o'):
+	    editorSortLines(0);
+	    break;
+	case CTRL_KEY('u'):
+	    editorSortLines(1);
 	    break;
 	default:
 	    editorInsertChar(c);
 	    break;
     }
-    quit_times = KILO_QUIT_TIMES;
+    E.quit_times = KILO_QUIT_TIMES;
 }
 
 /*** init ***/
 
-void initEditor() {
+// Resets everything about the buffer and the view of it, but leaves the
+// terminal alone
+void initBuffer() {
     E.cx = 0;
     E.cy = 0;
     E.rx = 0;
@@ -1084,18 +5586,529 @@ void initEditor() {
     E.statusmsg[0] = '\0';
     E.statusmsg_time = 0;
     E.syntax = NULL;
+    E.resized = 0;
+    E.wrap = 0;
+    editorWrapInvalidate();
+    E.byteindex.measure = editorRowBytes;
+    rowIndexBuild(&E.byteindex);
+    E.brackets.stale = 1;
+    editorUndoClear();
+    E.markx = 0;
+    E.marky = -1;
+    E.ncursors = 0;
+    E.quit_times = KILO_QUIT_TIMES;
+    E.watchfd = -1;
+    E.diskchanged = 0;
+    E.tailoff = 0;
+    E.tailpartial = 0;
+    E.diskhash = NULL;
+    E.disklines = 0;
+    E.diskexact = 0;
+    E.changelo = -1;
+    E.changetail = 0;
+    E.follow = 0;
+    E.evicted = 0;
+    E.hex = 0;
+    E.hexmap = NULL;
+    E.hexsize = 0;
+    E.hexcur = 0;
+    E.hextop = 0;
+}
 
+void initEditor() {
+    initBuffer();
+    E.infd = STDIN_FILENO;
+    E.outfd = STDOUT_FILENO;
+    E.current = -1;
+    editorInitEvents();
     if(getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
     E.screenrows -= 2;
+    if(E.screenrows < 1) E.screenrows = 1;
 }
 
-int main(int argc, char *argv[]) {
+// Opens the file given on the command line, if any
+void editorStartup(char *filename, int follow) {
+    if(filename) editorOpen(filename);
+    if(follow) editorToggleFollow();
+    // Opening may have had something to say already
+    if(E.statusmsg[0] == '\0')
+	editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+}
+
+/*** server ***/
+
+// Several terminals can share one buffer through a server that owns it.
+// Clients send their keys and terminal size over a Unix socket and get back
+// only the screen lines that changed, so another viewer of a large file
+// costs a screenful per frame rather than another copy of the file. The
+// server swaps each client's view in and out of E and runs the same
+// editorProcessKeypress on its keys. A prompt is part of the view of the
+// client it's up in, which answers it with its own keys while the others
+// carry on. So is a job piping rows through a command, whose pipes the
+// server polls along with the clients. The others can look at the buffer
+// but not change it until the job is done
+
+void editorSaveView(struct editorView *v) {
+    v->cx = E.cx;
+    v->cy = E.cy;
+    v->rowoff = E.rowoff;
+    v->coloff = E.coloff;
+    v->screenrows = E.screenrows;
+    v->screencols = E.screencols;
+    v->wrap = E.wrap;
+    v->markx = E.markx;
+    v->marky = E.marky;
+    v->cursors = E.cursors;
+    v->ncursors = E.ncursors;
+    v->capcursors = E.capcursors;
+    v->primary = E.primary;
+    v->hexcur = E.hexcur;
+    v->hextop = E.hextop;
+    memcpy(v->statusmsg, E.statusmsg, sizeof(v->statusmsg));
+    v->statusmsg_time = E.statusmsg_time;
+    v->quit_times = E.quit_times;
+    v->prompt = E.prompt;
+    v->pipe = E.pipe;
+}
+
+void editorLoadView(struct editorView *v) {
+    E.cx = v->cx;
+    E.cy = v->cy;
+    E.rowoff = v->rowoff;
+    E.coloff = v->coloff;
+    E.screenrows = v->screenrows;
+    E.screencols = v->screencols;
+    E.wrap = v->wrap;
+    E.markx = v->markx;
+    E.marky = v->marky;
+    E.cursors = v->cursors;
+    E.ncursors = v->ncursors;
+    E.capcursors = v->capcursors;
+    E.primary = v->primary;
+    E.hexcur = v->hexcur;
+    E.hextop = v->hextop;
+    memcpy(E.statusmsg, v->statusmsg, sizeof(E.statusmsg));
+    E.statusmsg_time = v->statusmsg_time;
+    E.quit_times = v->quit_times;
+    E.prompt = v->prompt;
+    E.pipe = v->pipe;
+
+    // Other clients may have deleted the rows this one was on
+    int j;
+    for(j = 0; j < E.ncursors; j++) {
+	struct cursor *c = &E.cursors[j];
+	if(c->cy > E.numrows || c->cx > (c->cy < E.numrows ? E.row[c->cy].size : 0))
+	    E.ncursors = 0;
+    }
+    if(E.marky > E.numrows) E.marky = -1;
+    editorClampCursor();
+}
+
+void editorSwitchClient(int k) {
+    if(E.current == k) return;
+    if(E.current != -1) editorSaveView(&E.clients[E.current].view);
+    editorLoadView(&E.clients[k].view);
+    E.current = k;
+    E.infd = E.outfd = E.clients[k].fd;
+}
+
+// A new client starts where the buffer was last looked at, without the
+// mark and cursors someone else left there
+void editorAddClient(int fd) {
+    E.clients = realloc(E.clients, sizeof(struct editorClient) * (E.nclients + 1));
+    struct editorClient *c = &E.clients[E.nclients];
+    memset(c, 0, sizeof(*c));
+    c->fd = fd;
+    editorSaveView(&c->view);
+    c->view.cursors = NULL;
+    c->view.ncursors = 0;
+    c->view.capcursors = 0;
+    c->view.marky = -1;
+    c->view.quit_times = KILO_QUIT_TIMES;
+    c->view.prompt = NULL;
+    c->view.pipe = NULL;
+    if(E.nclients) {
+	snprintf(c->view.statusmsg, sizeof(c->view.statusmsg),
+		"%d terminals share this buffer", E.nclients + 1);
+	c->view.statusmsg_time = time(NULL);
+    }
+    E.nclients++;
+}
+
+void editorDropClient(int k) {
+    // Whatever it was asked goes unanswered and what it ran is cancelled
+    if(E.current == k ? E.prompt != NULL : E.clients[k].view.prompt != NULL) {
+	editorSwitchClient(k);
+	while (E.prompt) editorPromptKey('\x1b');
+    }
+    if(editorClientPipe(k)) {
+	editorSwitchClient(k);
+	pipeEnd(1);
+    }
+    struct editorClient *c = &E.clients[k];
+    int y;
+    close(c->fd);
+    for(y = 0; y < c->nlines; y++) free(c->lines[y]);
+    free(c->lines);
+    free(c->lens);
+    free(c->out);
+    if(E.current == k) {
+	// E was using its cursors
+	free(E.cursors);
+	E.cursors = NULL;
+	E.ncursors = E.capcursors = 0;
+	E.current = -1;
+	E.infd = E.outfd = -1;
+    } else {
+	free(c->view.cursors);
+    }
+    memmove(c, c + 1, sizeof(struct editorClient) * (E.nclients - k - 1));
+    E.nclients--;
+    if(E.current > k) E.current--;
+}
+
+// Sends the current client the lines of a frame that differ from the last
+// one it got. The body holds the screen lines separated by "\r\n", each of
+// which redraws its line completely
+void editorSendFrame(const char *body, int len, const char *cursor) {
+    struct editorClient *c = &E.clients[E.current];
+    struct abuf ab = ABUF_INIT;
+    int y, nlines = E.screenrows + 2, changed = 0;
+    abAppend(&ab, "\x1b[?25l", 6);
+    // A new or resized terminal gets all of it
+    if(nlines != c->nlines || E.screencols != c->cols) {
+	for(y = 0; y < c->nlines; y++) free(c->lines[y]);
+	c->lines = realloc(c->lines, sizeof(char *) * nlines);
+	c->lens = realloc(c->lens, sizeof(int) * nlines);
+	for(y = 0; y < nlines; y++) {
+	    c->lines[y] = NULL;
+	    c->lens[y] = -1;
+	}
+	c->nlines = nlines;
+	c->cols = E.screencols;
+	abAppend(&ab, "\x1b[2J", 4);
+    }
+
+    const char *p = body, *end = body + len;
+    for(y = 0; y < nlines && p <= end; y++) {
+	const char *eol = memmem(p, end - p, "\r\n", 2);
+	if(eol == NULL) eol = end;
+	int n = eol - p;
+	if(n != c->lens[y] || memcmp(p, c->lines[y], n)) {
+	    char pos[16];
+	    int plen = snprintf(pos, sizeof(pos), "\x1b[%d;1H", y + 1);
+	    abAppend(&ab, pos, plen);
+	    abAppend(&ab, p, n);
+	    c->lines[y] = realloc(c->lines[y], n + 1);
+	    memcpy(c->lines[y], p, n);
+	    c->lens[y] = n;
+	    changed = 1;
+	}
+	p = eol + 2;
+    }
+
+    if(changed || strcmp(cursor, c->cursor)) {
+	abAppend(&ab, cursor, strlen(cursor));
+	abAppend(&ab, "\x1b[?25h", 6);
+	snprintf(c->cursor, sizeof(c->cursor), "%s", cursor);
+	// A terminal that stopped reading isn't worth keeping its frames
+	if(c->outlen + ab.len > KILO_CLIENT_BACKLOG) {
+	    c->gone = 1;
+	} else {
+	    c->out = realloc(c->out, c->outlen + ab.len);
+	    memcpy(&c->out[c->outlen], ab.b, ab.len);
+	    c->outlen += ab.len;
+	    editorFlushClient(c);
+	}
+    }
+    abFree(&ab);
+}
+
+// Writes as much of what a client is owed as its socket takes without
+// blocking, the rest goes out once poll says it has room
+void editorFlushClient(struct editorClient *c) {
+    while (c->outlen) {
+	int n = write(c->fd, c->out, c->outlen);
+	if(n == -1) {
+	    if(errno == EINTR) continue;
+	    if(errno != EAGAIN) c->gone = 1;
+	    return;
+	}
+	memmove(c->out, &c->out[n], c->outlen - n);
+	c->outlen -= n;
+    }
+}
+
+// Sends every client its frame and returns the milliseconds until one of
+// them has a message to take down, -1 for none. A client that hasn't taken
+// its last frame yet gets the next one once it has, with everything that
+// changed in between
+int editorRefreshClients() {
+    int k, timeout = -1;
+    for(k = 0; k < E.nclients; k++) {
+	if(E.clients[k].outlen) continue;
+	editorSwitchClient(k);
+	editorRefreshScreen();
+	int t = editorNextTimeout();
+	if(t != -1 && (timeout == -1 || t < timeout)) timeout = t;
+    }
+    return timeout;
+}
+
+// The job a client has running, NULL for none
+struct pipeJob *editorClientPipe(int k) {
+    return E.current == k ? E.pipe : E.clients[k].view.pipe;
+}
+
+// The job of a client other than the current one, which only one can have
+// running at a time. NULL in a terminal
+struct pipeJob *editorBusy() {
+    int k;
+    for(k = 0; k < E.nclients; k++)
+	if(k != E.current && E.clients[k].view.pipe) return E.clients[k].view.pipe;
+    return NULL;
+}
+
+void editorServe(int lfd) {
+    struct pollfd *fds = NULL;
+    int timeout = -1, k;
+    while (1) {
+	int n = E.nclients;
+	fds = realloc(fds, sizeof(struct pollfd) * (3 * n + 2));
+	fds[0].fd = lfd;
+	fds[0].events = POLLIN;
+	fds[1].fd = E.watchfd;
+	fds[1].events = POLLIN;
+	for(k = 0; k < n; k++) {
+	    fds[k + 2].fd = E.clients[k].fd;
+	    fds[k + 2].events = POLLIN | (E.clients[k].outlen ? POLLOUT : 0);
+	}
+	// Then the pipes of the clients' jobs, a pair for each client
+	for(k = 0; k < n; k++) {
+	    struct pipeJob *job = editorClientPipe(k);
+	    struct pollfd *p = &fds[n + 2 + 2 * k];
+	    p[0].fd = job ? job->in : -1;
+	    p[0].events = POLLOUT;
+	    p[1].fd = job ? job->out : -1;
+	    p[1].events = POLLIN;
+	}
+	if(poll(fds, 3 * n + 2, timeout) == -1) {
+	    if(errno == EINTR) continue;
+	    die("poll");
+	}
+
+	if(fds[1].revents & POLLIN) {
+	    char buf[4096];
+	    while (read(E.watchfd, buf, sizeof(buf)) > 0);
+	    E.diskchanged = 1;
+	}
+	// A conflict with the file on disk is asked about by the first
+	// client without a prompt up, or once one of them is answered
+	for(k = 0; E.diskchanged && k < n; k++) {
+	    editorSwitchClient(k);
+	    editorCheckDisk();
+	}
+	for(k = 0; k < n; k++)
+	    if(fds[k + 2].revents & POLLOUT) editorFlushClient(&E.clients[k]);
+	for(k = 0; k < n; k++) {
+	    struct pollfd *p = &fds[n + 2 + 2 * k];
+	    if(!p[0].revents && !p[1].revents) continue;
+	    editorSwitchClient(k);
+	    if(E.pipe && !pipeStep(E.pipe, p[0].revents, p[1].revents)) pipeEnd(0);
+	}
+	for(k = 0; k < n; k++) {
+	    if(!(fds[k + 2].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+	    struct pollfd pfd = {E.clients[k].fd, POLLIN, 0};
+	    editorSwitchClient(k);
+	    // Everything the client typed so far goes in before the next frame
+	    do {
+		editorProcessKeypress();
+	    } while (!E.clients[k].gone && poll(&pfd, 1, 0) == 1);
+	}
+
+	for(k = E.nclients - 1; k >= 0; k--)
+	    if(E.clients[k].gone) editorDropClient(k);
+	int jobs = 0;
+	for(k = 0; k < E.nclients; k++) {
+	    if(editorClientPipe(k) == NULL) continue;
+	    editorSwitchClient(k);
+	    pipeProgress(E.pipe);
+	    jobs = 1;
+	}
+	timeout = editorRefreshClients();
+	if(jobs && (timeout == -1 || timeout > KILO_PROGRESS_INTERVAL))
+	    timeout = KILO_PROGRESS_INTERVAL;
+	for(k = E.nclients - 1; k >= 0; k--)
+	    if(E.clients[k].gone) editorDropClient(k);
+	// New clients get their first frame once their terminal size is in
+	if(fds[0].revents & POLLIN) {
+	    int fd = accept(lfd, NULL, NULL);
+	    if(fd != -1) {
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+		editorAddClient(fd);
+	    }
+	}
+    }
+}
+
+void editorRemoveSocket() {
+    unlink(E.socketpath);
+}
+
+int editorSocketAddr(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr->sun_path)) {
+	errno = ENAMETOOLONG;
+	return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+int editorConnect(const char *path) {
+    struct sockaddr_un addr;
+    if(editorSocketAddr(path, &addr) == -1) return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd == -1) return -1;
+    if(connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+	close(fd);
+	return -1;
+    }
+    return fd;
+}
+
+// Starts a server for filename listening on path in the background. The
+// socket accepts connections by the time this returns 0, the file is opened
+// after that
+int editorStartServer(char *path, char *filename, int follow) {
+    struct sockaddr_un addr;
+    if(editorSocketAddr(path, &addr) == -1) return -1;
+    int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(lfd == -1) return -1;
+    // Left behind by a server that didn't get to clean up
+    struct stat st;
+    if(stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+    if(bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+	    listen(lfd, 16) == -1) {
+	close(lfd);
+	return -1;
+    }
+
+    pid_t pid = fork();
+    if(pid == -1) {
+	close(lfd);
+	unlink(path);
+	return -1;
+    }
+    if(pid) {
+	close(lfd);
+	return 0;
+    }
+
+    // Nothing here is tied to the terminal that started it
+    setsid();
+    int null = open("/dev/null", O_RDWR);
+    dup2(null, STDIN_FILENO);
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    if(null > STDERR_FILENO) close(null);
+    fcntl(lfd, F_SETFD, FD_CLOEXEC);
+    E.socketpath = path;
+    atexit(editorRemoveSocket);
+
+    initBuffer();
+    editorInitEvents();
+    E.screenrows = 22;
+    E.screencols = 80;
+    E.infd = E.outfd = -1;
+    E.current = -1;
+    editorLoadSyntaxDefinitions();
+    editorStartup(filename, follow);
+    editorServe(lfd);
+    exit(0);
+}
+
+void editorSendWindowSize(int fd) {
+    int rows, cols;
+    if(getWindowSize(&rows, &cols) == -1) return;
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "\x1b[8;%d;%dt", rows, cols);
+    write(fd, buf, len);
+}
+
+// The terminal end of a connection to a server. Keys go to the server as
+// they are typed and what comes back is written to the screen as it is
+int editorAttach(int fd) {
     enableRawMode();
     initEditor();
-    if (argc >= 2) {
-	editorOpen(argv[1]);
+    editorSendWindowSize(fd);
+    char buf[KILO_PIPE_CHUNK];
+    while (1) {
+	struct pollfd fds[3] = {
+	    {STDIN_FILENO, POLLIN, 0}, {fd, POLLIN, 0}, {E.wakefd[0], POLLIN, 0}
+	};
+	if(poll(fds, 3, -1) == -1) {
+	    if(errno == EINTR) continue;
+	    break;
+	}
+	if(fds[2].revents & POLLIN) {
+	    while (read(E.wakefd[0], buf, sizeof(buf)) > 0);
+	    editorSendWindowSize(fd);
+	}
+	if(fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+	    int n = read(STDIN_FILENO, buf, sizeof(buf));
+	    if(n <= 0 || write(fd, buf, n) != n) break;
+	}
+	// The server closes the connection when we quit
+	if(fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+	    int n = read(fd, buf, sizeof(buf));
+	    if(n <= 0 || write(STDOUT_FILENO, buf, n) != n) break;
+	}
+    }
+    write(STDOUT_FILENO, "\x1b[2J", 4);
+    write(STDOUT_FILENO, "\x1b[H", 3);
+    return 0;
+}
+
+#ifndef KILO_NO_MAIN
+int main(int argc, char *argv[]) {
+    // -f follows the file as it grows, -n keeps only its last rows, -s
+    // shares the buffer with every other kilo started with the same socket,
+    // -x shows the file as hex even if it looks like text
+    int opt, follow = 0;
+    char *socketpath = NULL;
+    while ((opt = getopt(argc, argv, "fn:s:x")) != -1) {
+	if(opt == 'f') follow = 1;
+	else if(opt == 'n') E.followmax = atoi(optarg);
+	else if(opt == 's') socketpath = optarg;
+	else if(opt == 'x') E.hexopen = 1;
+	// Fewer than one row would have follow mode evict past the end
+	if(opt == '?' || (opt == 'n' && E.followmax < 1)) {
+	    fprintf(stderr, "usage: %s [-f] [-n rows] [-s socket] [-x] [file]\n",
+		    argv[0]);
+	    return 1;
+	}
+    }
+    char *filename = optind < argc ? argv[optind] : NULL;
+
+    if(socketpath) {
+	// The first one to use the socket starts the server
+	int fd = editorConnect(socketpath);
+	if(fd == -1 && editorStartServer(socketpath, filename, follow) == 0)
+	    fd = editorConnect(socketpath);
+	if(fd == -1) {
+	    perror(socketpath);
+	    return 1;
+	}
+	return editorAttach(fd);
     }
-    editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+
+    enableRawMode();
+    initEditor();
+    editorLoadSyntaxDefinitions();
+    editorStartup(filename, follow);
     
     // Read 1 byte character from input into c
     while(1) {
@@ -1104,3 +6117,4 @@ int main(int argc, char *argv[]) {
     }
     return 0;
 }
+#endif